@@ -49,6 +49,9 @@ struct code_seg_t
 {
 	struct inst_t *text;
 	uint32_t size;
+	void *map;    // Image mapping backing [text], NULL if text is malloc'd
+	size_t mapsz;
+	uint32_t refcnt; // Number of processes sharing this segment
 };
 
 struct trans_table_t
@@ -83,6 +86,7 @@ struct pcb_t
 	struct code_seg_t *code; // Code segment
 	addr_t regs[10];	 // Registers, store address of allocated regions
 	uint32_t pc;		 // Program pointer, point to the next instruction
+	int killed;		 // Set by killall, its CPU tears it down
 	struct queue_t *ready_queue;
 	struct queue_t *running_list;
 #ifdef MLQ_SCHED
@@ -94,9 +98,8 @@ struct pcb_t
 #ifdef MM_PAGING
 	struct mm_struct *mm;
 	struct memphy_struct *mram;
-	struct memphy_struct **mswp;
-	struct memphy_struct *active_mswp;
-	uint32_t active_mswp_id;
+	struct memphy_struct *mswp;	 // PAGING_MAX_MMSWP devices, by swap type
+	uint32_t io_stall;	 // Device latency to serve, MEMPHY cost units
 #endif
 	struct page_table_t *page_table; // Page table
 	uint32_t bp;			 // Break pointer
@@ -3,7 +3,46 @@
 
 #include "common.h"
 
+/* Precompiled process image: a header followed by a packed array of
+ * [size] instructions. Images are produced by oscc (or by the loader
+ * cache) and mapped directly into the code segment. */
+#define IMG_MAGIC	0x4d49534f	/* "OSIM" */
+#define IMG_VERSION	2
+#define IMG_SUFFIX	".img"
+#define IMG_ALIGN	64	/* Instructions start on a cache line */
+
+struct img_hdr_t {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t inst_sz;	/* sizeof(struct inst_t) of the producer */
+	uint32_t priority;
+	uint32_t size;		/* Number of instructions */
+	uint64_t src_mtime;	/* Source mtime (ns) the image was built from */
+	uint8_t reserved[IMG_ALIGN - 24];
+};
+
+/* Create a process from the program at [path]. Processes loaded from
+ * the same path share one read-only code segment. Return NULL if there
+ * is no program at [path] */
 struct pcb_t * load(const char * path);
 
+/* Same as load() with a pid taken earlier from alloc_pid(), so loaders
+ * running out of order still number processes in arrival order */
+struct pcb_t * load_pid(const char * path, uint32_t pid);
+
+uint32_t alloc_pid(void);
+
+/* Release the code, memory and page table of a process, on exit or
+ * when killed. The pcb itself is left to the caller */
+void terminate_process(struct pcb_t * pcb);
+
+/* Drop a reference to a code segment returned by load(). The segment
+ * is released when its last process is gone */
+void put_code(struct code_seg_t * code);
+
+/* Compile the text program at [src] into an image at [dst].
+ * Return 0 on success. Otherwise, return -1 */
+int compile_image(const char * src, const char * dst);
+
 #endif
 
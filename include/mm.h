@@ -3,8 +3,11 @@
 #include "bitops.h"
 #include "common.h"
 
-/* CPU Bus definition */
+/* CPU Bus definition, os-cfg.h may widen it up to 31 bits (VM addresses
+ * are int) */
+#ifndef PAGING_CPU_BUS_WIDTH
 #define PAGING_CPU_BUS_WIDTH 22 /* 22bit bus - MAX SPACE 4MB */
+#endif
 #define PAGING_PAGESZ  256      /* 256B or 8-bits PAGE NUMBER */
 #define PAGING_MEMRAMSZ BIT(21)
 #define PAGING_PAGE_ALIGNSZ(sz) (DIV_ROUND_UP(sz,PAGING_PAGESZ)*PAGING_PAGESZ)
@@ -13,18 +16,59 @@
 #define PAGING_SWPFPN_OFFSET 5  
 #define PAGING_MAX_PGN  (DIV_ROUND_UP(BIT(PAGING_CPU_BUS_WIDTH),PAGING_PAGESZ))
 
+/* Radix page table: PAGING_PT_LEVELS levels of nodes, each indexed by
+ * PAGING_PT_BITS bits of the page number. Nodes are allocated on first
+ * use, leaves hold the PTEs */
+#ifndef PAGING_PT_LEVELS
+#define PAGING_PT_LEVELS 2
+#endif
+#define PAGING_PGN_BITS (PAGING_CPU_BUS_WIDTH - NBITS(PAGING_PAGESZ))
+#define PAGING_PT_BITS  DIV_ROUND_UP(PAGING_PGN_BITS, PAGING_PT_LEVELS)
+#define PAGING_PT_SIZE  (1 << PAGING_PT_BITS)
+
 #define PAGING_SBRK_INIT_SZ PAGING_PAGESZ
+
+/* Page replacement scope */
+#define MM_REPLACE_LOCAL  0 /* Victims from the faulting process */
+#define MM_REPLACE_GLOBAL 1 /* Victims from any process sharing MEMRAM */
+
+/* Page replacement policy */
+#define MM_POLICY_FIFO   0 /* Oldest mapping */
+#define MM_POLICY_SECOND 1 /* FIFO, accessed pages requeued once */
+#define MM_POLICY_CLOCK  2 /* Hand sweeping the resident pages */
+#define MM_POLICY_AGING  3 /* Least recently used by aging counters */
+
+/* ALLOC flags, the optional third argument of the alloc instruction */
+#define PAGING_ALLOC_CONTIG   BIT(0) /* Physically contiguous frames */
+#define PAGING_ALLOC_POPULATE BIT(1) /* Map frames now, not on first touch */
+#define PAGING_ALLOC_VMA_SHIFT 8     /* Bits 8 and up: target VM area */
+#define PAGING_ALLOC_VMA(id)  ((id) << PAGING_ALLOC_VMA_SHIFT)
+
+/* VM areas. Each one grows up inside its own window of the address
+ * space: heap the lower half, then mmap, shared and stack eighths */
+#define VMA_HEAP   0
+#define VMA_MMAP   1
+#define VMA_SHARED 2
+#define VMA_STACK  3
+
+/* Slab size classes: powers of two from 16 bytes to MM_SLAB_MAX */
+#define MM_SLAB_MIN_SHIFT 4
+#if MM_SLAB_MAX > (1 << (MM_SLAB_MIN_SHIFT + MM_SLAB_NCLASS - 1))
+#error "MM_SLAB_MAX needs more slab size classes"
+#endif
+
 /* PTE BIT */
 #define PAGING_PTE_PRESENT_MASK BIT(31) 
 #define PAGING_PTE_SWAPPED_MASK BIT(30)
 #define PAGING_PTE_RESERVE_MASK BIT(29)
 #define PAGING_PTE_DIRTY_MASK BIT(28)
-#define PAGING_PTE_EMPTY01_MASK BIT(14)
+#define PAGING_PTE_ACCESSED_MASK BIT(14)
 #define PAGING_PTE_EMPTY02_MASK BIT(13)
 
 /* PTE BIT PRESENT */
 #define PAGING_PTE_SET_PRESENT(pte) (pte=pte|PAGING_PTE_PRESENT_MASK)
 #define PAGING_PAGE_PRESENT(pte) (pte&PAGING_PTE_PRESENT_MASK)
+#define PAGING_PAGE_ACCESSED(pte) (pte&PAGING_PTE_ACCESSED_MASK)
 
 /* USRNUM */
 #define PAGING_PTE_USRNUM_LOBIT 15
@@ -50,6 +94,7 @@
 #define PAGING_PTE_PGN(pte)   GETVAL(pte,PAGING_PGN_MASK,PAGING_ADDR_PGN_LOBIT)
 #define PAGING_PTE_FPN(pte)   GETVAL(pte,PAGING_PTE_FPN_MASK,PAGING_PTE_FPN_LOBIT)
 #define PAGING_PTE_SWP(pte)   GETVAL(pte,PAGING_PTE_SWPOFF_MASK,PAGING_SWPFPN_OFFSET)
+#define PAGING_PTE_SWPTYP(pte) GETVAL(pte,PAGING_PTE_SWPTYP_MASK,PAGING_PTE_SWPTYP_LOBIT)
 
 /* OFFSET */
 #define PAGING_ADDR_OFFST_LOBIT 0
@@ -71,6 +116,9 @@
 /* Value operators */
 #define SETBIT(v,mask) (v=v|mask)
 #define CLRBIT(v,mask) (v=v&~mask)
+/* The same on a PTE another CPU may update concurrently */
+#define SETBIT_ATOMIC(v,mask) __sync_fetch_and_or(&(v),mask)
+#define CLRBIT_ATOMIC(v,mask) __sync_fetch_and_and(&(v),~(mask))
 
 #define SETVAL(v,value,mask,offst) (v=(v&~mask)|((value<<offst)&mask))
 #define GETVAL(v,mask,offst) ((v&mask)>>offst)
@@ -93,22 +141,30 @@
 /* Extract SWAPTYPE */
 #define PAGING_FPN(x)  GETVAL(x,PAGING_PTE_FPN_MASK,PAGING_PTE_FPN_LOBIT)
 
-/* Memory range operator */
-/* TODO implement the INCLUDE and OVERLAP checking mechanism */
-#define INCLUDE(x1,x2,y1,y2) (0)
-#define OVERLAP(x1,x2,y1,y2) (0)
+/* Memory range operator, on half-open ranges [x1,x2) and [y1,y2) */
+#define INCLUDE(x1,x2,y1,y2) ((y1) >= (x1) && (y2) <= (x2))
+#define OVERLAP(x1,x2,y1,y2) ((y1) < (x2) && (x1) < (y2))
 
 /* VM region prototypes */
 struct vm_rg_struct * init_vm_rg(int rg_start, int rg_endi);
 int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct* rgnode);
-int enlist_pgn_node(struct pgn_t **pgnlist, int pgn);
+int pgring_push(struct pg_ring *r, int pgn);
+int pgring_remove(struct pg_ring *r, int pgn);
+int pgring_free(struct pg_ring *r);
 int vmap_page_range(struct pcb_t *caller, int addr, int pgnum, 
                     struct framephy_struct *frames, struct vm_rg_struct *ret_rg);
-int vm_map_ram(struct pcb_t *caller, int astart, int send, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg);
+int vm_map_ram(struct pcb_t *caller, int astart, int send, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg, int flags);
+int vm_reserve_range(struct pcb_t *caller, int addr, int pgnum);
+int vm_unmap_range(struct pcb_t *caller, int addr, int pgnum);
 int alloc_pages_range(struct pcb_t *caller, int incpgnum, struct framephy_struct **frm_lst);
+int alloc_pages_contig(struct pcb_t *caller, int incpgnum, struct framephy_struct **frm_lst);
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                 struct memphy_struct *mpdst, int dstfpn) ;
 int pte_set_fpn(uint32_t *pte, int fpn);
+uint32_t *pte_lookup(struct mm_struct *mm, int pgn);
+uint32_t *pte_get(struct mm_struct *mm, int pgn);
+uint32_t *pte_next(struct mm_struct *mm, int *pgn);
+int pt_free(struct mm_struct *mm);
 int pte_set_swap(uint32_t *pte, int swptyp, int swpoff);
 int init_pte(uint32_t *pte,
              int pre,    // present
@@ -117,11 +173,12 @@ int init_pte(uint32_t *pte,
              int swp,    // swap
              int swptyp, // swap type
              int swpoff); //swap offset
-int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr);
+int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int flags, int *alloc_addr);
 int __free(struct pcb_t *caller, int vmaid, int rgid);
 int __read(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE *data);
 int __write(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE value);
 int init_mm(struct mm_struct *mm, struct pcb_t *caller);
+int free_mm(struct pcb_t *caller);
 
 /* VM prototypes */
 int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
@@ -138,26 +195,67 @@ int pgwrite(
 		uint32_t offset);
 /* Local VM prototypes */
 struct vm_rg_struct * get_symrg_byid(struct mm_struct* mm, int rgid);
+struct vm_rg_struct * get_symrg_slot(struct mm_struct* mm, int rgid);
+int put_symrg_byid(struct mm_struct* mm, int rgid);
+int free_symrg_table(struct mm_struct* mm);
 int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend);
 int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg);
-int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz);
+struct vm_rg_struct *enlist_vm_freerg_list(struct vm_area_struct *vma, struct vm_rg_struct *rg_elmt);
+int resize_vm_freerg(struct vm_area_struct *vma, struct vm_rg_struct *rg, unsigned long start, unsigned long end);
+int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz, int flags);
+int dec_vma_limit(struct pcb_t *caller, int vmaid, struct vm_rg_struct *tail);
 int find_victim_page(struct mm_struct* mm, int *pgn);
+int mm_evict_frame(struct pcb_t *caller, int *fpn);
+int mm_kswapd(struct memphy_struct *mram, struct memphy_struct *mswp,
+              uint32_t *stall);
+int mm_set_wmark(int low, int high);
+int mm_set_swap_prio(int swptyp, int prio);
+int mm_kswapd_enabled(void);
+int mm_kswapd_needed(void);
+int mm_set_replace(const char *scope, const char *policy);
+void mm_dump_stat(void);
+int mm_set_slab(const char *onoff);
+int mm_slab_release(struct mm_struct *mm);
+int mm_set_check(const char *onoff);
+int mm_check(struct pcb_t *caller);
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid);
+struct vm_area_struct *get_vma_by_addr(struct mm_struct *mm, unsigned long addr);
 
 /* MEM/PHY protypes */
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *fpn);
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn);
+int MEMPHY_nr_free(struct memphy_struct *mp);
+int MEMPHY_get_freefp_order(struct memphy_struct *mp, int order, int *fpn);
+int MEMPHY_get_fragstat(struct memphy_struct *mp, struct memphy_fragstat *st);
+int MEMPHY_dump_fragstat(struct memphy_struct *mp, const char *name);
 int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value);
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data);
+int MEMPHY_read_block(struct memphy_struct *mp, int addr, BYTE *buf, int len);
+int MEMPHY_write_block(struct memphy_struct *mp, int addr, const BYTE *buf,
+                       int len);
+int MEMPHY_copy_frame(struct memphy_struct *src, int srcfpn,
+                      struct memphy_struct *dst, int dstfpn);
 int MEMPHY_dump(struct memphy_struct * mp);
+int MEMPHY_set_owner(struct memphy_struct *mp, int fpn,
+                     struct mm_struct *owner, int pgn);
+struct framephy_struct *MEMPHY_get_frame(struct memphy_struct *mp, int fpn);
+int MEMPHY_dump_frames(struct memphy_struct *mp, const char *name);
+int MEMPHY_pick_victim(struct memphy_struct *mp, struct mm_struct *self,
+                       int floor, int policy, int *fpn,
+                       struct mm_struct **owner, int *pgn);
+int MEMPHY_age_frames(struct memphy_struct *mp);
+void MEMPHY_set_cpu(int cpu);
+int MEMPHY_drain_pcp(struct memphy_struct *mp);
+int MEMPHY_check(struct memphy_struct *mp, const char *name);
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg);
+int init_memphy_backed(struct memphy_struct *mp, int max_size, int randomflg,
+                       const char *path);
+int free_memphy(struct memphy_struct *mp);
 
 /* print list */
 int print_list_fp(struct framephy_struct *fp);
 int print_list_rg(struct vm_rg_struct *rg);
 int print_list_vma(struct vm_area_struct *rg);
 
-
-int print_list_pgn(struct pgn_t *ip);
 int print_pgtbl(struct pcb_t *ip, uint32_t start, uint32_t end);
 #endif
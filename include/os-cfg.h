@@ -11,4 +11,74 @@
 #define IODUMP 1
 #define PAGETBL_DUMP 1
 
+/* Cache compiled images of text programs next to their source */
+#define LOADER_IMG_CACHE 1
+
+/* Host threads preparing processes ahead of their start time, and how
+ * many upcoming processes may be prepared at once */
+#define LD_WORKERS 2
+#define LD_WINDOW 16
+/* Host time an idle arrival FIFO holds each time slot */
+#define LD_FIFO_IDLE_MS 10
+
+/* Give the host memory (or file blocks) of freed MEMPHY frames back as
+ * soon as a whole host page of frames is free */
+#define MEMPHY_RELEASE_FREED 1
+
+/* Free frames each CPU takes from a device at once into its own cache,
+ * so most allocations skip the device lock */
+#define MEMPHY_PCP_BATCH 8
+
+/* Swap devices are tape-like sequential devices instead of RAM-like */
+//#define MEMSWP_SEQUENTIAL
+/* Latency model of sequential devices, in cost units. A process stalls
+ * one time slot per MEMPHY_COST_PER_SLOT units of its transfers */
+#define MEMPHY_COST_PER_SLOT 1000
+#define MEMPHY_SEEK_BASE 200 /* Any cursor move */
+#define MEMPHY_SEEK_COST 1   /* Per KB of cursor travel */
+#define MEMPHY_XFER_COST 1   /* Per byte transferred */
+
+/* Page replacement scope (MM_REPLACE_*) and policy (MM_POLICY_*), which
+ * a 'replace <scope> [<policy>]' config line overrides. Global
+ * replacement leaves each other process MM_RSS_FLOOR resident pages */
+#define MM_REPLACE_SCOPE MM_REPLACE_LOCAL
+#define MM_REPLACE_POLICY MM_POLICY_FIFO
+#define MM_RSS_FLOOR 2
+/* Times a fault waits for a victim while the frames of every other
+ * process are in the middle of a memory operation */
+#define MM_EVICT_RETRY 100
+
+/* Free RAM frames below which the kswapd reclaim thread wakes up, and
+ * above which it goes back to sleep, evicting at most MM_KSWAPD_BATCH
+ * pages per time slot. A 'wmark <low> <high>' config line overrides
+ * them; a low watermark of 0 leaves all reclaim to the faults */
+#define MM_WMARK_LOW 0
+#define MM_WMARK_HIGH 0
+#define MM_KSWAPD_BATCH 8
+
+/* Each VM area takes swap slots in clusters of MM_SWAP_CLUSTER
+ * contiguous frames (a power of two), so pages evicted together sit
+ * together on swap. A swap-in reads ahead up to MM_SWAP_RA_MAX more
+ * pages of the same cluster into free frames, 0 for none */
+#define MM_SWAP_CLUSTER 8
+#define MM_SWAP_RA_MAX 8
+
+/* Free pages at the top of the heap given back to the frame allocator */
+#define MM_HEAP_TRIM_PAGES 1
+
+/* Serve allocations up to MM_SLAB_MAX bytes from slabs of whole pages
+ * holding at least MM_SLAB_OBJS objects, which a 'slab on|off' config
+ * line overrides */
+#define MM_SLAB 1
+#define MM_SLAB_MAX 256
+#define MM_SLAB_OBJS 4
+
+/* Region ids below this are kept in a dense array, others are hashed */
+#define MM_SYMTBL_DENSE_MAX 1024
+
+/* Virtual address width (at most 31 bits) and depth of the radix page
+ * table. Page table memory grows with the touched range only */
+//#define PAGING_CPU_BUS_WIDTH 31
+//#define PAGING_PT_LEVELS 3
+
 #endif
@@ -1,18 +1,37 @@
 #ifndef OSMM_H
 #define OSMM_H
 
+#include <sys/types.h> /* pthread_mutex_t; pthread.h would pull in our sched.h */
 
 #define MM_PAGING
 #define PAGING_MAX_MMSWP 4 /* max number of supported swapped space */
-#define PAGING_MAX_SYMTBL_SZ 30
+#define MEMPHY_BM_MAXLV 6  /* 64^6 frames, far beyond any device size */
+#define MEMPHY_MAX_ORDER 10 /* Largest contiguous block: 2^10 frames */
+#define VM_FREEBIN_NR 32    /* Free region bins, one per power of two */
+#define MM_SLAB_NCLASS 8    /* Slab size classes, 16 bytes and up */
+#define MM_NR_VMA 4         /* VM areas per process, see VMA_* */
+#define MEMPHY_NR_PCP 8     /* Per-CPU frame caches, CPUs above share */
 
 typedef char BYTE;
 typedef uint32_t addr_t;
 //typedef unsigned int uint32_t;
 
-struct pgn_t{
-   int pgn;
-   struct pgn_t *pg_next; 
+/*
+ *  Resident pages of a process in mapping order, oldest at head. Slots
+ *  of pages removed out of order hold -1 until compacted. The arrays
+ *  double when full, so mapping a page never allocates on its own.
+ */
+struct pg_ring {
+   int *pgn;
+   uint8_t *age;  /* Aging counters, MSB = accessed in the last period */
+   int cap;
+   int head;
+   int count;     /* Slots in use, holes included */
+   int holes;
+   int hand;      /* CLOCK hand, as an offset from head */
+   int *hash;     /* Slots by hash of their pgn, -1 if empty, linear
+                   * probing over twice the capacity of the ring */
+   int hbits;
 };
 
 /*
@@ -22,7 +41,50 @@ struct vm_rg_struct {
    unsigned long rg_start;
    unsigned long rg_end;
 
+   /* Free regions only: address order, then size bin */
    struct vm_rg_struct *rg_next;
+   struct vm_rg_struct *rg_prev;
+   struct vm_rg_struct *bin_next;
+   struct vm_rg_struct *bin_prev;
+   /* Free regions only: treap by rg_start, heap ordered by rg_prio */
+   struct vm_rg_struct *rg_left;
+   struct vm_rg_struct *rg_right;
+   uint32_t rg_prio;
+
+   /* Allocated regions only: slab the region was carved from */
+   struct mm_slab *rg_slab;
+};
+
+/*
+ *  Region table: ids below MM_SYMTBL_DENSE_MAX index a dense array grown
+ *  on demand, larger ids live in an open-addressing hash
+ */
+struct symrg_hent {
+   int id;               /* SYMRG_EMPTY, SYMRG_TOMB or a region id */
+   struct vm_rg_struct rg;
+};
+
+struct mm_symtbl {
+   struct vm_rg_struct *dense;
+   int ndense;
+   struct symrg_hent *hash;
+   int hcap;             /* Power of two */
+   int hused;            /* Live entries and tombstones */
+   int hlive;
+};
+
+/*
+ *  Slab of same-sized small regions, carved from one heap region
+ */
+struct mm_slab {
+   unsigned long base;   /* Address of the first object */
+   int size;             /* Bytes, whole pages */
+   int objsz;
+   int nobj;
+   int nfree;
+   uint64_t freemap;     /* Bit set: object free */
+   struct mm_slab *next;
+   struct mm_slab *prev;
 };
 
 /*
@@ -34,12 +96,21 @@ struct vm_area_struct {
    unsigned long vm_end;
 
    unsigned long sbrk;
+   unsigned long vm_limit;  /* The area never grows past this address */
 /*
  * Derived field
  * unsigned long vm_limit = vm_end - vm_start
  */
    struct mm_struct *vm_mm;
-   struct vm_rg_struct *vm_freerg_list;
+   struct vm_rg_struct *vm_freerg_list;  /* Sorted, neighbours coalesced */
+   struct vm_rg_struct *vm_freerg_root;  /* Same regions, by address */
+   struct vm_rg_struct *vm_freebins[VM_FREEBIN_NR]; /* By log2 of size */
+   uint32_t vm_freebin_map;              /* Non-empty bins */
+   /* Swap cluster the area evicts into: slots [swp_next, swp_end) of
+    * device swp_type are reserved for it */
+   int swp_type;
+   int swp_next;
+   int swp_end;
    struct vm_area_struct *vm_next;
 };
 
@@ -47,15 +118,35 @@ struct vm_area_struct {
  * Memory management struct
  */
 struct mm_struct {
-   uint32_t *pgd;
+   void *pgd;       /* Root of the radix page table, see pte_lookup() */
+   long pt_bytes;   /* Memory held by the page table */
 
    struct vm_area_struct *mmap;
+   /* The same areas by id, which is also address order */
+   struct vm_area_struct *vmas[MM_NR_VMA];
+
+   /* Regions by id, see get_symrg_byid() */
+   struct mm_symtbl symtbl;
 
-   /* Currently we support a fixed number of symbol */
-   struct vm_rg_struct symrgtbl[PAGING_MAX_SYMTBL_SZ];
+   /* Slabs with free objects, by size class, and full slabs */
+   struct mm_slab *slab_partial[MM_SLAB_NCLASS];
+   struct mm_slab *slab_full;
 
-   /* list of free page */
-   struct pgn_t *fifo_pgn;
+   /* Resident pages, in the order replacement considers them */
+   struct pg_ring pgring;
+
+   uint32_t pid; /* Owner process, for diagnostics */
+   int rss;      /* Pages resident in MEMRAM */
+
+   /* Swap readahead window, and read ahead pages used since the last
+    * swap-in */
+   int ra_win;
+   int ra_hits;
+
+   /* Held over each memory operation of the process, and by a fault
+    * of another process taking one of its frames. Recursive, as the
+    * library issues memory syscalls under it */
+   pthread_mutex_t lock;
 };
 
 /*
@@ -64,23 +155,72 @@ struct mm_struct {
 struct framephy_struct { 
    int fpn;
    struct framephy_struct *fp_next;
+   struct framephy_struct *fp_prev;
 
    /* Resereed for tracking allocated framed */
    struct mm_struct* owner;
+   int pgn; /* Page of owner mapped to this frame */
+   uint8_t age; /* Aging counter for global replacement */
+   int swpslot; /* RAM frames: swap frame + 1 holding a copy, 0 if none */
+   uint8_t swptyp; /* RAM frames: swap device of that copy */
+   uint8_t busy; /* Being filled or emptied, off limits to eviction */
+   uint8_t ra; /* Read ahead and not accessed yet */
+};
+
+/*
+ * Buddy view of the free frames of a device
+ */
+struct memphy_fragstat {
+   int numfp;
+   int nfree;
+   int max_order; /* Largest order with a free block, -1 if none */
+   int nblocks[MEMPHY_MAX_ORDER + 1]; /* Maximal free blocks per order */
+};
+
+/*
+ * Free frames cached by one CPU, taken from the device in batches
+ */
+struct memphy_pcp {
+   pthread_mutex_t lock;
+   int count;
+   int fpn[MEMPHY_PCP_BATCH]; /* Lowest frame last */
 };
 
 struct memphy_struct {
    /* Basic field of data and size */
    BYTE *storage;
    int maxsz;
+
+   /* Storage is mapped lazily, from a file when fd >= 0. The file is
+    * created for the device and removed with it */
+   int fd;
+   char *path;
+   int host_pgsz;
    
    /* Sequential device fields */ 
    int rdmflg;
    int cursor;
-
-   /* Management structure */
-   struct framephy_struct *free_fp_list;
-   struct framephy_struct *used_fp_list;
+   uint64_t busy_until; /* Cost units, end of the transfers queued */
+   pthread_mutex_t io_lock; /* Cursor and transfers */
+
+   /* Management structure: a hierarchical bitmap of frames. A set bit
+    * in level 0 is a used frame, a set bit in level n+1 is a full word
+    * of level n. The top level is a single word. */
+   int numfp;
+   int nfree;
+   int bm_levels;
+   uint64_t *bm[MEMPHY_BM_MAXLV];
+   pthread_mutex_t fp_lock;
+
+   /* Frame table indexed by fpn: the owner of each used frame, NULL
+    * for free frames. Left zeroed, so untouched entries cost nothing.
+    * Owned frames are chained in mapping order, oldest first */
+   struct framephy_struct *frmtbl;
+   struct framephy_struct *used_head;
+   struct framephy_struct *used_tail;
+
+   /* Frames handed to CPU caches stay set in the bitmap */
+   struct memphy_pcp pcp[MEMPHY_NR_PCP];
 };
 
 #endif
@@ -11,7 +11,8 @@ struct queue_t {
 	int size;
 };
 
-void enqueue(struct queue_t * q, struct pcb_t * proc);
+/* Return -1 when [q] is full, leaving it unchanged */
+int enqueue(struct queue_t * q, struct pcb_t * proc);
 
 struct pcb_t * dequeue(struct queue_t * q);
 
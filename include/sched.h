@@ -1,5 +1,5 @@
-#ifndef QUEUE_H
-#define QUEUE_H
+#ifndef SCHED_H
+#define SCHED_H
 
 #include "common.h"
 
@@ -20,8 +20,20 @@ struct pcb_t * get_proc(void);
 /* Put a process back to run queue */
 void put_proc(struct pcb_t * proc);
 
-/* Add a new process to ready queue */
-void add_proc(struct pcb_t * proc);
+/* Add a new process to ready queue. Return -1, leaving it out, when
+ * MAX_QUEUE_SIZE processes are already live */
+int add_proc(struct pcb_t * proc);
+
+/* Forget a process about to be freed, dropping it from the running list */
+void drop_proc(struct pcb_t * proc);
+
+/* Take the processes running program [name] off the scheduler, except
+ * [caller]. Up to [max] ready ones leave every queue and are returned
+ * in [procs], for the caller to free. Those on a CPU are marked killed,
+ * so that their CPU tears them down as on a normal exit.
+ * Return the number of processes in [procs] */
+int take_procs(const char * name, struct pcb_t * caller,
+		struct pcb_t ** procs, int max);
 
 #endif
 
@@ -38,7 +38,7 @@ int run(struct pcb_t *proc)
 /* ---- ALLOC ------------------------------------------------------ */
     case ALLOC:
 #ifdef MM_PAGING
-        rc = liballoc(proc, ins.arg_0, ins.arg_1);
+        rc = liballoc(proc, ins.arg_0, ins.arg_1, ins.arg_2);
 #else
         if (gpr_ok(ins.arg_1)) rc = alloc_plain(proc, ins.arg_0, ins.arg_1);
 #endif
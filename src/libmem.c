@@ -21,8 +21,19 @@
  #include <stdlib.h>
  #include <stdio.h>
  #include <pthread.h>
+ #include <time.h>
+ 
+ /*
+  * Locking: the lib* entry points hold the lock of the calling process
+  * over the whole operation, so its areas, regions, page table and page
+  * ring only change under it. A fault needing a frame of another
+  * process takes that process's lock too, with a trylock under fp_lock
+  * (see MEMPHY_pick_victim()), and skips it if busy. Frames are handed
+  * out by the devices under fp_lock, through per-CPU caches. Accessed
+  * and dirty bits are set and cleared atomically, as victim selection
+  * ages the PTEs of other processes.
+  */
  
- static pthread_mutex_t mmvm_lock = PTHREAD_MUTEX_INITIALIZER;
  static void dump_freerg(struct mm_struct *mm,const char *tag)
 {
     struct vm_rg_struct *rg = mm->mmap->vm_freerg_list;
@@ -30,24 +41,251 @@
     while (rg){ printf("[%ld..%ld)->",rg->rg_start,rg->rg_end); rg=rg->rg_next; }
     puts("NULL");
 }
+
+ /* Free regions are binned by the log2 of their size */
+ static int freerg_bin(unsigned long size)
+ {
+   return 31 - __builtin_clz((uint32_t)size);
+ }
+ 
+ static void freerg_bin_link(struct vm_area_struct *vma, struct vm_rg_struct *rg)
+ {
+   int b = freerg_bin(rg->rg_end - rg->rg_start);
+ 
+   rg->bin_prev = NULL;
+   rg->bin_next = vma->vm_freebins[b];
+   if (rg->bin_next != NULL)
+     rg->bin_next->bin_prev = rg;
+   vma->vm_freebins[b] = rg;
+   vma->vm_freebin_map |= BIT(b);
+ }
+ 
+ static void freerg_bin_unlink(struct vm_area_struct *vma, struct vm_rg_struct *rg)
+ {
+   int b = freerg_bin(rg->rg_end - rg->rg_start);
+ 
+   if (rg->bin_prev != NULL)
+     rg->bin_prev->bin_next = rg->bin_next;
+   else
+     vma->vm_freebins[b] = rg->bin_next;
+   if (rg->bin_next != NULL)
+     rg->bin_next->bin_prev = rg->bin_prev;
+   if (vma->vm_freebins[b] == NULL)
+     vma->vm_freebin_map &= ~BIT(b);
+ }
+ 
+ static void freerg_unlink(struct vm_area_struct *vma, struct vm_rg_struct *rg)
+ {
+   if (rg->rg_prev != NULL)
+     rg->rg_prev->rg_next = rg->rg_next;
+   else
+     vma->vm_freerg_list = rg->rg_next;
+   if (rg->rg_next != NULL)
+     rg->rg_next->rg_prev = rg->rg_prev;
+ }
+ 
+ /* Free regions are also kept in a treap by address, so that the
+  * neighbours of a freed region are found in O(log n). Priorities hash
+  * the start address at insertion and never change, so moving the
+  * bounds of a region within its old ones keeps the treap valid */
+ static void freerg_tree_insert(struct vm_rg_struct **root,
+                                struct vm_rg_struct *rg)
+ {
+   struct vm_rg_struct *t = *root;
+ 
+   if (t == NULL) {
+     rg->rg_left = rg->rg_right = NULL;
+     *root = rg;
+     return;
+   }
+   if (rg->rg_start < t->rg_start) {
+     freerg_tree_insert(&t->rg_left, rg);
+     if (t->rg_left->rg_prio > t->rg_prio) {
+       *root = t->rg_left;
+       t->rg_left = (*root)->rg_right;
+       (*root)->rg_right = t;
+     }
+   } else {
+     freerg_tree_insert(&t->rg_right, rg);
+     if (t->rg_right->rg_prio > t->rg_prio) {
+       *root = t->rg_right;
+       t->rg_right = (*root)->rg_left;
+       (*root)->rg_left = t;
+     }
+   }
+ }
+ 
+ static void freerg_tree_erase(struct vm_rg_struct **root,
+                               struct vm_rg_struct *rg)
+ {
+   struct vm_rg_struct *t;
+ 
+   while (*root != rg)
+     root = rg->rg_start < (*root)->rg_start ? &(*root)->rg_left
+                                             : &(*root)->rg_right;
+   /* Rotate it down until it has a single child */
+   while (rg->rg_left != NULL && rg->rg_right != NULL) {
+     if (rg->rg_left->rg_prio > rg->rg_right->rg_prio) {
+       t = rg->rg_left;
+       rg->rg_left = t->rg_right;
+       t->rg_right = rg;
+       *root = t;
+       root = &t->rg_right;
+     } else {
+       t = rg->rg_right;
+       rg->rg_right = t->rg_left;
+       t->rg_left = rg;
+       *root = t;
+       root = &t->rg_left;
+     }
+   }
+   *root = rg->rg_left != NULL ? rg->rg_left : rg->rg_right;
+ }
+ 
+ /* Last free region starting before @addr, NULL if none */
+ static struct vm_rg_struct *freerg_tree_prev(struct vm_area_struct *vma,
+                                              unsigned long addr)
+ {
+   struct vm_rg_struct *t = vma->vm_freerg_root;
+   struct vm_rg_struct *prev = NULL;
+ 
+   while (t != NULL) {
+     if (t->rg_start < addr) {
+       prev = t;
+       t = t->rg_right;
+     } else {
+       t = t->rg_left;
+     }
+   }
+   return prev;
+ }
+ 
  /*enlist_vm_freerg_list - add new rg to freerg_list
-  *@mm: memory region
-  *@rg_elmt: new region
+  *@vma: area the region belongs to
+  *@rg_elmt: new region, owned by the list from now on
   *
+  *The list is kept in address order and the new region is merged with
+  *its free neighbours right away. Returns the region holding @rg_elmt
+  *after merging, NULL if it was empty or overlaps a free region.
   */
- int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct *rg_elmt)
+ struct vm_rg_struct *enlist_vm_freerg_list(struct vm_area_struct *vma,
+                                            struct vm_rg_struct *rg_elmt)
  {
-   struct vm_rg_struct *rg_node = mm->mmap->vm_freerg_list;
+   struct vm_rg_struct *prev = freerg_tree_prev(vma, rg_elmt->rg_start);
+   struct vm_rg_struct *next = prev != NULL ? prev->rg_next
+                                            : vma->vm_freerg_list;
  
-   if (rg_elmt->rg_start >= rg_elmt->rg_end)
-     return -1;
+   if (rg_elmt->rg_start >= rg_elmt->rg_end ||
+       (prev != NULL && prev->rg_end > rg_elmt->rg_start) ||
+       (next != NULL && next->rg_start < rg_elmt->rg_end)) {
+     free(rg_elmt);
+     return NULL;
+   }
  
-   if (rg_node != NULL)
-     rg_elmt->rg_next = rg_node;
+   if (prev != NULL && prev->rg_end == rg_elmt->rg_start) {
+     /* Grow the previous hole */
+     freerg_bin_unlink(vma, prev);
+     prev->rg_end = rg_elmt->rg_end;
+     free(rg_elmt);
+     rg_elmt = prev;
+   } else {
+     rg_elmt->rg_prev = prev;
+     rg_elmt->rg_next = next;
+     if (prev != NULL)
+       prev->rg_next = rg_elmt;
+     else
+       vma->vm_freerg_list = rg_elmt;
+     if (next != NULL)
+       next->rg_prev = rg_elmt;
+     rg_elmt->rg_prio = (uint32_t)rg_elmt->rg_start * 2654435761u;
+     freerg_tree_insert(&vma->vm_freerg_root, rg_elmt);
+   }
+ 
+   if (next != NULL && rg_elmt->rg_end == next->rg_start) {
+     /* Swallow the next hole */
+     freerg_bin_unlink(vma, next);
+     freerg_unlink(vma, next);
+     freerg_tree_erase(&vma->vm_freerg_root, next);
+     rg_elmt->rg_end = next->rg_end;
+     free(next);
+   }
+ 
+   freerg_bin_link(vma, rg_elmt);
+   return rg_elmt;
+ }
+ 
+ /*resize_vm_freerg - move the bounds of a free region
+  *@vma: area the region belongs to
+  *@rg: free region, released when it becomes empty
+  *
+  *The new bounds must stay within the old ones.
+  */
+ int resize_vm_freerg(struct vm_area_struct *vma, struct vm_rg_struct *rg,
+                      unsigned long start, unsigned long end)
+ {
+   freerg_bin_unlink(vma, rg);
+   if (start >= end) {
+     freerg_unlink(vma, rg);
+     freerg_tree_erase(&vma->vm_freerg_root, rg);
+     free(rg);
+     return 0;
+   }
+   rg->rg_start = start;
+   rg->rg_end = end;
+   freerg_bin_link(vma, rg);
+   return 0;
+ }
+ 
+#define SYMRG_EMPTY (-1)
+#define SYMRG_TOMB  (-2)
+ 
+ /* Home slot of a hashed region id (Fibonacci hashing) */
+ static int symrg_hash(struct mm_symtbl *t, int rgid)
+ {
+   return ((uint32_t)rgid * 2654435769u) >> (32 - __builtin_ctz(t->hcap));
+ }
+ 
+ /* Slot holding @rgid, or the slot to insert it at when @insert is set */
+ static struct symrg_hent *symrg_probe(struct mm_symtbl *t, int rgid,
+                                       int insert)
+ {
+   struct symrg_hent *tomb = NULL;
+   int i = symrg_hash(t, rgid);
+ 
+   for (;; i = (i + 1) & (t->hcap - 1)) {
+     struct symrg_hent *e = &t->hash[i];
+ 
+     if (e->id == rgid)
+       return e;
+     if (e->id == SYMRG_TOMB && tomb == NULL)
+       tomb = e;
+     if (e->id == SYMRG_EMPTY)
+       return insert ? (tomb ? tomb : e) : NULL;
+   }
+ }
  
-   /* Enlist the new region */
-   mm->mmap->vm_freerg_list = rg_elmt;
+ /* Rehash into @cap slots, dropping the tombstones */
+ static int symrg_rehash(struct mm_symtbl *t, int cap)
+ {
+   struct symrg_hent *old = t->hash;
+   int oldcap = t->hcap;
+   int i;
  
+   t->hash = malloc(cap * sizeof(struct symrg_hent));
+   if (t->hash == NULL) {
+     t->hash = old;
+     return -1;
+   }
+   t->hcap = cap;
+   t->hused = 0;
+   for (i = 0; i < cap; i++)
+     t->hash[i].id = SYMRG_EMPTY;
+   for (i = 0; i < oldcap; i++)
+     if (old[i].id >= 0) {
+       *symrg_probe(t, old[i].id, 1) = old[i];
+       t->hused++;
+     }
+   free(old);
    return 0;
  }
  
@@ -55,13 +293,324 @@
   *@mm: memory region
   *@rgid: region ID act as symbol index of variable
   *
+  *Returns NULL for an id that was never allocated. The entry of a freed
+  *region may be returned, empty.
   */
  struct vm_rg_struct *get_symrg_byid(struct mm_struct *mm, int rgid)
  {
-   if (rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
+   struct mm_symtbl *t = &mm->symtbl;
+   struct symrg_hent *e;
+ 
+   if (rgid < 0)
+     return NULL;
+   if (rgid < t->ndense)
+     return &t->dense[rgid];
+   if (rgid < MM_SYMTBL_DENSE_MAX || t->hcap == 0)
+     return NULL;
+ 
+   e = symrg_probe(t, rgid, 0);
+   return e ? &e->rg : NULL;
+ }
+ 
+ /*get_symrg_slot - get the entry of a region ID, adding it if needed
+  *
+  *The dense array doubles to cover the id. The hash is rebuilt past 3/4
+  *load, twice as large unless tombstones made most of the load. Either
+  *may move the entries.
+  */
+ struct vm_rg_struct *get_symrg_slot(struct mm_struct *mm, int rgid)
+ {
+   struct mm_symtbl *t = &mm->symtbl;
+   struct symrg_hent *e;
+ 
+   if (rgid < 0)
+     return NULL;
+ 
+   if (rgid < MM_SYMTBL_DENSE_MAX) {
+     if (rgid >= t->ndense) {
+       int n = t->ndense ? t->ndense : 32;
+       struct vm_rg_struct *dense;
+ 
+       while (n <= rgid)
+         n *= 2;
+       if (n > MM_SYMTBL_DENSE_MAX)
+         n = MM_SYMTBL_DENSE_MAX;
+       dense = realloc(t->dense, n * sizeof(struct vm_rg_struct));
+       if (dense == NULL)
+         return NULL;
+       memset(&dense[t->ndense], 0,
+              (n - t->ndense) * sizeof(struct vm_rg_struct));
+       t->dense = dense;
+       t->ndense = n;
+     }
+     return &t->dense[rgid];
+   }
+ 
+   if ((t->hused + 1) * 4 > t->hcap * 3 &&
+       symrg_rehash(t, t->hcap == 0 ? 16 :
+                       (t->hlive + 1) * 2 > t->hcap ? t->hcap * 2 : t->hcap) < 0)
      return NULL;
+   e = symrg_probe(t, rgid, 1);
+   if (e->id != rgid) {
+     if (e->id == SYMRG_EMPTY)
+       t->hused++;
+     t->hlive++;
+     e->id = rgid;
+     memset(&e->rg, 0, sizeof(e->rg));
+   }
+   return &e->rg;
+ }
+ 
+ /*put_symrg_byid - forget a freed region ID
+  */
+ int put_symrg_byid(struct mm_struct *mm, int rgid)
+ {
+   struct mm_symtbl *t = &mm->symtbl;
+   struct symrg_hent *e;
+ 
+   if (rgid < 0)
+     return -1;
+   if (rgid < t->ndense) {
+     memset(&t->dense[rgid], 0, sizeof(struct vm_rg_struct));
+     return 0;
+   }
+   if (rgid < MM_SYMTBL_DENSE_MAX || t->hcap == 0 ||
+       (e = symrg_probe(t, rgid, 0)) == NULL)
+     return -1;
+ 
+   /* Tombstones count as used until the next rehash */
+   e->id = SYMRG_TOMB;
+   t->hlive--;
+   return 0;
+ }
+ 
+ int free_symrg_table(struct mm_struct *mm)
+ {
+   free(mm->symtbl.dense);
+   free(mm->symtbl.hash);
+   memset(&mm->symtbl, 0, sizeof(mm->symtbl));
+   return 0;
+ }
+ 
+ static int mm_check_on = 0;
+ 
+ static int mm_slab_on =
+ #ifdef MM_SLAB
+   1;
+ #else
+   0;
+ #endif
+ 
+ /* Heap counters over all processes, reported at shutdown */
+ static struct {
+   unsigned long allocs;
+   unsigned long slab_allocs;
+   unsigned long frees;
+   unsigned long alloc_ns;
+   unsigned long free_ns;
+   unsigned long req_bytes;    /* Asked for by successful allocations */
+   unsigned long got_bytes;    /* Taken from the heap for them */
+   unsigned long slabs;        /* Slabs created */
+   unsigned long checks;       /* Runs of mm_check() */
+   unsigned long check_errs;   /* Invariants found broken */
+ } heap_stat;
+ 
+ static unsigned long heap_clock(void)
+ {
+   struct timespec ts;
+ 
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+ }
+ 
+ /*mm_set_slab - turn the slab layer on or off
+  *@onoff: "on" or "off"
+  */
+ int mm_set_slab(const char *onoff)
+ {
+   if (!strcmp(onoff, "on"))
+     mm_slab_on = 1;
+   else if (!strcmp(onoff, "off"))
+     mm_slab_on = 0;
+   else
+     return -1;
+   return 0;
+ }
+ 
+ /*mm_set_check - check the paging state after each memory operation
+  *@onoff: "on" or "off"
+  */
+ int mm_set_check(const char *onoff)
+ {
+   if (!strcmp(onoff, "on"))
+     mm_check_on = 1;
+   else if (!strcmp(onoff, "off"))
+     mm_check_on = 0;
+   else
+     return -1;
+   return 0;
+ }
+ 
+ /*__alloc_rg - take a region from the free list, growing the heap once
+  *if no hole fits
+  */
+ static int __alloc_rg(struct pcb_t *caller, int vmaid, int size, int flags,
+                       struct vm_rg_struct *rgnode)
+ {
+   /* 1. try to reuse a free hole */
+   if (get_free_vmrg_area(caller, vmaid, size, rgnode) == 0)
+     return 0;
+ 
+   /* 2. grow the heap once */
+   int inc_sz = PAGING_PAGE_ALIGNSZ(size);
+   if (inc_vma_limit(caller, vmaid, inc_sz, flags) == 0 &&
+       get_free_vmrg_area(caller, vmaid, size, rgnode) == 0)
+     return 0;
+ 
+   return -1;
+ }
+ 
+ /*__free_rg - give [start, end) back to the free list
+  */
+ static int __free_rg(struct pcb_t *caller, int vmaid, unsigned long start,
+                      unsigned long end)
+ {
+   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+   if (cur_vma == NULL)
+     return -1;
+ 
+   /* merged with the holes around it */
+   struct vm_rg_struct *rg = enlist_vm_freerg_list(cur_vma,
+                                                   init_vm_rg(start, end));
+ 
+   /* a hole at the top of the heap goes back to the frame allocator */
+   if (rg != NULL)
+     dec_vma_limit(caller, vmaid, rg);
+   return 0;
+ }
+ 
+ static void slab_link(struct mm_slab **list, struct mm_slab *s)
+ {
+   s->prev = NULL;
+   s->next = *list;
+   if (s->next != NULL)
+     s->next->prev = s;
+   *list = s;
+ }
+ 
+ static void slab_unlink(struct mm_slab **list, struct mm_slab *s)
+ {
+   if (s->prev != NULL)
+     s->prev->next = s->next;
+   else
+     *list = s->next;
+   if (s->next != NULL)
+     s->next->prev = s->prev;
+ }
+ 
+ /* Size class of a small request: objects of 16 << class bytes */
+ static int slab_class(int size)
+ {
+   if (size <= (1 << MM_SLAB_MIN_SHIFT))
+     return 0;
+   return 32 - __builtin_clz(size - 1) - MM_SLAB_MIN_SHIFT;
+ }
+ 
+ /*slab_alloc - carve a small region from a slab of its size class
+  *
+  *Slabs with free objects are kept per class, so this takes the first
+  *free object of the first of them, or a new slab from the heap.
+  */
+ static int slab_alloc(struct pcb_t *caller, int vmaid, int size,
+                       struct vm_rg_struct *rgnode)
+ {
+   struct mm_struct *mm = caller->mm;
+   int cls = slab_class(size);
+   struct mm_slab *s = mm->slab_partial[cls];
+   int i;
+ 
+   if (s == NULL) {
+     struct vm_rg_struct slabrg = { 0 };
+     int objsz = 1 << (MM_SLAB_MIN_SHIFT + cls);
+     int slabsz = PAGING_PAGE_ALIGNSZ(MM_SLAB_OBJS * objsz);
+ 
+     if (__alloc_rg(caller, vmaid, slabsz, 0, &slabrg) < 0)
+       return -1;
+     s = malloc(sizeof(struct mm_slab));
+     s->base = slabrg.rg_start;
+     s->size = slabsz;
+     s->objsz = objsz;
+     s->nobj = slabsz / objsz;
+     if (s->nobj > 64)
+       s->nobj = 64;
+     s->nfree = s->nobj;
+     s->freemap = s->nobj == 64 ? ~0ULL : BIT_ULL(s->nobj) - 1;
+     slab_link(&mm->slab_partial[cls], s);
+     __sync_fetch_and_add(&heap_stat.slabs, 1);
+   }
+ 
+   i = __builtin_ctzll(s->freemap);
+   s->freemap &= ~BIT_ULL(i);
+   if (--s->nfree == 0) {
+     slab_unlink(&mm->slab_partial[cls], s);
+     slab_link(&mm->slab_full, s);
+   }
+ 
+   rgnode->rg_start = s->base + i * s->objsz;
+   rgnode->rg_end = rgnode->rg_start + size;
+   rgnode->rg_slab = s;
+#ifdef MMDBG
+   printf("[DBG]   slab %d-byte object %d of [%ld..%ld)\n",
+          s->objsz, i, s->base, s->base + s->size);
+#endif
+   return 0;
+ }
+ 
+ /*slab_free - put a small region back in its slab
+  *
+  *An empty slab goes back to the heap unless it is the last one of its
+  *class with free objects, which is kept for the next allocations.
+  */
+ static int slab_free(struct pcb_t *caller, int vmaid, struct vm_rg_struct *rg)
+ {
+   struct mm_struct *mm = caller->mm;
+   struct mm_slab *s = rg->rg_slab;
+   int cls = slab_class(s->objsz);
+   int i = (rg->rg_start - s->base) / s->objsz;
+ 
+   s->freemap |= BIT_ULL(i);
+   if (s->nfree++ == 0) {
+     slab_unlink(&mm->slab_full, s);
+     slab_link(&mm->slab_partial[cls], s);
+   }
+ 
+   if (s->nfree == s->nobj && (s->next != NULL || s->prev != NULL)) {
+     slab_unlink(&mm->slab_partial[cls], s);
+     __free_rg(caller, vmaid, s->base, s->base + s->size);
+     free(s);
+   }
+   return 0;
+ }
+ 
+ /*mm_slab_release - drop the slab descriptors of a dying mm
+  *
+  *Their memory goes away with the areas of the mm.
+  */
+ int mm_slab_release(struct mm_struct *mm)
+ {
+   struct mm_slab *s, *next;
+   int cls;
  
-   return &mm->symrgtbl[rgid];
+   for (cls = 0; cls <= MM_SLAB_NCLASS; cls++) {
+     s = cls < MM_SLAB_NCLASS ? mm->slab_partial[cls] : mm->slab_full;
+     for (; s != NULL; s = next) {
+       next = s->next;
+       free(s);
+     }
+   }
+   memset(mm->slab_partial, 0, sizeof(mm->slab_partial));
+   mm->slab_full = NULL;
+   return 0;
  }
  
  /*__alloc - allocate a region memory
@@ -74,31 +623,39 @@
   */
 /* libmem.c --------------------------------------------------- */
 int __alloc(struct pcb_t *caller,int vmaid,int rgid,
-            int size,int *alloc_addr)
+            int size,int flags,int *alloc_addr)
 {
     printf("[DBG] __alloc pid=%d vma=%d rgid=%d size=%d\n",
            caller->pid, vmaid, rgid, size);
 
-    struct vm_rg_struct rgnode;
+    struct vm_rg_struct *sym = get_symrg_slot(caller->mm, rgid);
+    if (sym == NULL || size <= 0)
+        return -1;
 
-    /* 1. try to reuse a free hole */
-    if (get_free_vmrg_area(caller, vmaid, size, &rgnode) == 0) {
-      caller->mm->symrgtbl[rgid] = rgnode;
-      *alloc_addr = rgnode.rg_start;
-      dump_freerg(caller->mm,"after alloc");          /* DBG */
-      return 0;
-  }
+    struct vm_rg_struct rgnode = { 0 };
 
-    /* 2. grow the heap once */
-    int inc_sz = PAGING_PAGE_ALIGNSZ(size);
-    if (inc_vma_limit(caller, vmaid, inc_sz) == 0 &&
-        get_free_vmrg_area(caller, vmaid, size, &rgnode) == 0) {
-        caller->mm->symrgtbl[rgid] = rgnode;
+    /* small regions come from slabs, unless they need whole pages */
+    if (mm_slab_on && size <= MM_SLAB_MAX && flags == 0 && vmaid == VMA_HEAP) {
+        if (slab_alloc(caller, vmaid, size, &rgnode) == 0) {
+            *sym = rgnode;
+            *alloc_addr = rgnode.rg_start;
+            __sync_fetch_and_add(&heap_stat.slab_allocs, 1);
+            __sync_fetch_and_add(&heap_stat.req_bytes, size);
+            __sync_fetch_and_add(&heap_stat.got_bytes, rgnode.rg_slab->objsz);
+            return 0;
+        }
+        /* no room for a new slab, a hole of [size] may still do */
+    }
+    if (__alloc_rg(caller, vmaid, size, flags, &rgnode) == 0) {
+        *sym = rgnode;
         *alloc_addr = rgnode.rg_start;
+        __sync_fetch_and_add(&heap_stat.req_bytes, size);
+        __sync_fetch_and_add(&heap_stat.got_bytes, size);
+        dump_freerg(caller->mm,"after alloc");          /* DBG */
         return 0;
     }
 
-    /* 3. out of memory */
+    /* out of memory */
     printf("[DBG]   allocation failed\n");
     return -1;
 }
@@ -114,26 +671,28 @@ int __alloc(struct pcb_t *caller,int vmaid,int rgid,
   */
  int __free(struct pcb_t *caller, int vmaid, int rgid)
  {
-     if (rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ)
-         return -1;
- 
      /* take a snapshot of the region we are about to free */
-     struct vm_rg_struct *old = &caller->mm->symrgtbl[rgid];
-     if (old->rg_start == old->rg_end)
+     if (rgid < 0)
+         return -1;
+     struct vm_rg_struct *old = get_symrg_byid(caller->mm, rgid);
+     if (old == NULL || old->rg_start == old->rg_end)
          return 0;                           /* already freed */
  
-     struct vm_rg_struct *clone = malloc(sizeof(struct vm_rg_struct));
-     clone->rg_start = old->rg_start;
-     clone->rg_end   = old->rg_end;
-     clone->rg_next  = NULL;
+     /* the region goes back to the area it came from */
+     struct vm_area_struct *cur_vma = get_vma_by_addr(caller->mm, old->rg_start);
+     if (cur_vma != NULL)
+         vmaid = cur_vma->vm_id;
  
-     /* reset symbol-table entry */
-     old->rg_start = old->rg_end = 0;
- 
-     /* put the clone on the free-list */
-     enlist_vm_freerg_list(caller->mm, clone);
      printf("[DBG] __free pid=%d rgid=%d  [%ld..%ld)\n",
-            caller->pid, rgid, clone->rg_start, clone->rg_end);
+            caller->pid, rgid, old->rg_start, old->rg_end);
+ 
+     if (old->rg_slab != NULL)
+         slab_free(caller, vmaid, old);
+     else if (__free_rg(caller, vmaid, old->rg_start, old->rg_end) < 0)
+         return -1;
+ 
+     /* reset symbol-table entry */
+     put_symrg_byid(caller->mm, rgid);
      dump_freerg(caller->mm,"after free");               /* DBG */
      return 0;
  }
@@ -144,14 +703,25 @@ int __alloc(struct pcb_t *caller,int vmaid,int rgid,
   *@proc:  Process executing the instruction
   *@size: allocated size
   *@reg_index: memory region ID (used to identify variable in symbole table)
+  *@flags: PAGING_ALLOC_* flags
   */
- int liballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
+ int liballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index,
+              uint32_t flags)
  {
-   /* TODO Implement allocation on vm area 0 */
    int addr = 0;
+   unsigned long t0 = heap_clock();
  
-   /* By default using vmaid = 0 */
-   return __alloc(proc, 0, reg_index, size, &addr);
+   /* The high flag bits pick the area, the heap by default */
+   pthread_mutex_lock(&proc->mm->lock);
+   int ret = __alloc(proc, flags >> PAGING_ALLOC_VMA_SHIFT, reg_index, size,
+                     flags & (PAGING_ALLOC_CONTIG | PAGING_ALLOC_POPULATE),
+                     &addr);
+   if (mm_check_on)
+     mm_check(proc);
+   pthread_mutex_unlock(&proc->mm->lock);
+   __sync_fetch_and_add(&heap_stat.alloc_ns, heap_clock() - t0);
+   __sync_fetch_and_add(&heap_stat.allocs, 1);
+   return ret;
  }
  
  /*libfree - PAGING-based free a region memory
@@ -163,9 +733,457 @@ int __alloc(struct pcb_t *caller,int vmaid,int rgid,
  int libfree(struct pcb_t *proc, uint32_t reg_index)
  {
    /* TODO Implement free region */
+   unsigned long t0 = heap_clock();
  
    /* By default using vmaid = 0 */
-   return __free(proc, 0, reg_index);
+   pthread_mutex_lock(&proc->mm->lock);
+   int ret = __free(proc, 0, reg_index);
+   if (mm_check_on)
+     mm_check(proc);
+   pthread_mutex_unlock(&proc->mm->lock);
+   __sync_fetch_and_add(&heap_stat.free_ns, heap_clock() - t0);
+   __sync_fetch_and_add(&heap_stat.frees, 1);
+   return ret;
+ }
+ 
+ static int mm_replace_scope = MM_REPLACE_SCOPE;
+ static int mm_replace_policy = MM_REPLACE_POLICY;
+ static int mm_wmark_low = MM_WMARK_LOW;
+ static int mm_wmark_high = MM_WMARK_HIGH;
+ /* Swap device priorities: by default devices fill up in order */
+ static int mm_swap_prio[PAGING_MAX_MMSWP] = { 0, -1, -2, -3 };
+ 
+ static const char *mm_policy_name[] = {"fifo", "second", "clock", "aging"};
+ 
+ /* Paging counters over all processes, reported at shutdown */
+ static struct {
+   unsigned long accesses;
+   unsigned long faults;       /* Swap-ins */
+   unsigned long zero_fills;   /* First touches of reserved pages */
+   unsigned long evictions;
+   unsigned long swap_outs;    /* Pages written to swap */
+   unsigned long swap_outs_dev[PAGING_MAX_MMSWP]; /* Per swap device */
+   unsigned long clean_drops;  /* Evictions needing no write */
+   unsigned long direct;       /* Faults that had to evict a page */
+   unsigned long kswapd_wakes; /* Times free RAM fell below the low mark */
+   unsigned long kswapd_pages; /* Pages evicted in the background */
+   unsigned long swap_clusters; /* Swap clusters taken by VM areas */
+   unsigned long ra_pages;     /* Pages read ahead on swap-in */
+   unsigned long ra_hits;      /* Of which accessed while resident */
+   unsigned long ra_waste;     /* Of which evicted without an access */
+ } mm_stat;
+ 
+ /*mm_set_replace - select the page replacement
+  *@scope: "local" or "global"
+  *@policy: "fifo", "second", "clock" or "aging", NULL to keep it
+  */
+ int mm_set_replace(const char *scope, const char *policy)
+ {
+   int i;
+ 
+   if (!strcmp(scope, "local"))
+     mm_replace_scope = MM_REPLACE_LOCAL;
+   else if (!strcmp(scope, "global"))
+     mm_replace_scope = MM_REPLACE_GLOBAL;
+   else
+     return -1;
+ 
+   if (policy == NULL)
+     return 0;
+   for (i = 0; i < (int)(sizeof(mm_policy_name) / sizeof(char *)); i++) {
+     if (!strcmp(policy, mm_policy_name[i])) {
+       mm_replace_policy = i;
+       return 0;
+     }
+   }
+   return -1;
+ }
+ 
+ /*mm_set_wmark - set the free frame watermarks of kswapd
+  *@low: wake kswapd below @low free RAM frames, 0 to turn it off
+  *@high: put it back to sleep once @high frames are free
+  */
+ int mm_set_wmark(int low, int high)
+ {
+   if (low < 0 || high < low)
+     return -1;
+   mm_wmark_low = low;
+   mm_wmark_high = high;
+   return 0;
+ }
+ 
+ /*mm_set_swap_prio - set the priority of a swap device
+  *@swptyp: device, as in MEMSWP<swptyp>
+  *@prio: new swap slots go to the highest priority device with room,
+  *       striped over the devices of equal priority
+  */
+ int mm_set_swap_prio(int swptyp, int prio)
+ {
+   if (swptyp < 0 || swptyp >= PAGING_MAX_MMSWP)
+     return -1;
+   mm_swap_prio[swptyp] = prio;
+   return 0;
+ }
+ 
+ int mm_kswapd_enabled(void)
+ {
+   return mm_wmark_low > 0;
+ }
+
+ /* kswapd also runs the periodic aging pass of global AGING */
+ int mm_kswapd_needed(void)
+ {
+   return mm_kswapd_enabled() ||
+          (mm_replace_scope == MM_REPLACE_GLOBAL &&
+           mm_replace_policy == MM_POLICY_AGING);
+ }
+ 
+ void mm_dump_stat(void)
+ {
+   int i;
+ 
+   printf("Paging (%s %s replacement): %lu accesses, %lu faults (%.2f%%), "
+          "%lu zero fills, %lu evictions\n",
+          mm_replace_scope == MM_REPLACE_GLOBAL ? "global" : "local",
+          mm_policy_name[mm_replace_policy],
+          mm_stat.accesses, mm_stat.faults,
+          mm_stat.accesses ? 100.0 * mm_stat.faults / mm_stat.accesses : 0.0,
+          mm_stat.zero_fills, mm_stat.evictions);
+   printf("Swap I/O: %lu pages in, %lu pages out, %lu write backs saved\n",
+          mm_stat.faults + mm_stat.ra_pages, mm_stat.swap_outs,
+          mm_stat.clean_drops);
+   printf("Swap out per device:");
+   for (i = 0; i < PAGING_MAX_MMSWP; i++)
+     printf(" MEMSWP%d %lu", i, mm_stat.swap_outs_dev[i]);
+   printf("\n");
+   printf("Swap clusters: %lu taken, readahead %lu pages, %lu hits, "
+          "%lu wasted\n", mm_stat.swap_clusters, mm_stat.ra_pages,
+          mm_stat.ra_hits, mm_stat.ra_waste);
+   printf("Reclaim: %lu direct reclaim stalls", mm_stat.direct);
+   if (mm_kswapd_enabled())
+     printf(", kswapd (wmark %d %d) woke %lu times, evicted %lu pages",
+            mm_wmark_low, mm_wmark_high, mm_stat.kswapd_wakes,
+            mm_stat.kswapd_pages);
+   printf("\n");
+   printf("Heap (slab %s): %lu allocs (%lu from %lu slabs), %lu frees, "
+          "%lu ns/alloc, %lu ns/free, %.2f%% internal fragmentation\n",
+          mm_slab_on ? "on" : "off", heap_stat.allocs, heap_stat.slab_allocs,
+          heap_stat.slabs, heap_stat.frees,
+          heap_stat.allocs ? heap_stat.alloc_ns / heap_stat.allocs : 0,
+          heap_stat.frees ? heap_stat.free_ns / heap_stat.frees : 0,
+          heap_stat.got_bytes ?
+            100.0 * (heap_stat.got_bytes - heap_stat.req_bytes) /
+            heap_stat.got_bytes : 0.0);
+   if (mm_check_on)
+     printf("Checks: %lu runs, %lu broken invariants\n",
+            heap_stat.checks, heap_stat.check_errs);
+ }
+ 
+ /*swap_alloc - take 2^@order contiguous swap frames
+  *@mswp: the swap devices
+  *@order: block order
+  *@swptyp, @swpfpn: device and first frame of the block
+  *
+  *Devices are tried by decreasing priority. Among devices of equal
+  *priority, allocations go round robin, starting after the device used
+  *last, so consecutive clusters are striped over them.
+  */
+ static int swap_alloc(struct memphy_struct *mswp, int order, int *swptyp,
+                       int *swpfpn)
+ {
+   static int last = -1; /* Device used last, a hint */
+   int tried = 0, prio = 0, best, i, k, typ;
+ 
+   while (1) {
+     /* Highest priority below the levels tried */
+     best = -1;
+     for (i = 0; i < PAGING_MAX_MMSWP; i++) {
+       if (mswp[i].numfp == 0 || (tried && mm_swap_prio[i] >= prio))
+         continue;
+       if (best < 0 || mm_swap_prio[i] > mm_swap_prio[best])
+         best = i;
+     }
+     if (best < 0)
+       return -1;
+     prio = mm_swap_prio[best];
+     tried = 1;
+ 
+     i = __atomic_load_n(&last, __ATOMIC_RELAXED);
+     for (k = 1; k <= PAGING_MAX_MMSWP; k++) {
+       typ = (i + k + PAGING_MAX_MMSWP) % PAGING_MAX_MMSWP;
+       if (mswp[typ].numfp > 0 && mm_swap_prio[typ] == prio &&
+           MEMPHY_get_freefp_order(&mswp[typ], order, swpfpn) == 0) {
+         __atomic_store_n(&last, typ, __ATOMIC_RELAXED);
+         *swptyp = typ;
+         return 0;
+       }
+     }
+   }
+ }
+ 
+ /*swap_get_slot - take a swap frame for a page being evicted
+  *@vmm, @pgn: the page
+  *@mswp: the swap devices
+  *@swptyp, @swpfpn: device and swap frame
+  *
+  *Slots come from the swap cluster of the VM area of the page, a new
+  *one once it is used up, so the pages an area evicts in a row end up
+  *next to each other. A single slot is taken when no free cluster is
+  *left. The unused end of a cluster is released with the mm.
+  */
+ static int swap_get_slot(struct mm_struct *vmm, int pgn,
+                          struct memphy_struct *mswp, int *swptyp,
+                          int *swpfpn)
+ {
+   struct vm_area_struct *vma =
+     get_vma_by_addr(vmm, (unsigned long)pgn * PAGING_PAGESZ);
+   int base;
+ 
+   if (vma == NULL)
+     return swap_alloc(mswp, 0, swptyp, swpfpn);
+   if (vma->swp_next >= vma->swp_end) {
+     if (swap_alloc(mswp, __builtin_ctz(MM_SWAP_CLUSTER), &vma->swp_type,
+                    &base) < 0)
+       return swap_alloc(mswp, 0, swptyp, swpfpn);
+     vma->swp_next = base;
+     vma->swp_end = base + MM_SWAP_CLUSTER;
+     __sync_fetch_and_add(&mm_stat.swap_clusters, 1);
+   }
+   *swptyp = vma->swp_type;
+   *swpfpn = vma->swp_next++;
+   return 0;
+ }
+ 
+ /*swap_out_page - take a victim page out of its RAM frame
+  *@caller: process paying for the write, NULL for kswapd
+  *@mram, @mswp: RAM and the swap devices
+  *@vmm, @vicpgn, @vicfpn: the victim, off the used chain and busy
+  *@stall: device latency of the write, added to it
+  *
+  *A page that was never written is dropped, to be zero-filled again,
+  *and a clean page keeps its swap copy. Returns -1 if swap is full, in
+  *which case the victim is mapped back.
+  */
+ static int swap_out_page(struct pcb_t *caller, struct memphy_struct *mram,
+                          struct memphy_struct *mswp, struct mm_struct *vmm,
+                          int vicpgn, int vicfpn, uint32_t *stall)
+ {
+   uint32_t *pte = pte_lookup(vmm, vicpgn);
+   struct framephy_struct *fp = MEMPHY_get_frame(mram, vicfpn);
+   int swpslot = fp->swpslot;
+   int swptyp, swpfpn;
+ 
+   if (fp->ra) {
+     fp->ra = 0;
+     __sync_fetch_and_add(&mm_stat.ra_waste, 1);
+   }
+   if (!(*pte & PAGING_PTE_DIRTY_MASK) && swpslot == 0) {
+     /* Zero-filled and never written: it can be zero-filled again */
+     *pte = PAGING_PTE_RESERVE_MASK;
+     __sync_fetch_and_add(&mm_stat.clean_drops, 1);
+   } else {
+     if (swpslot > 0) {
+       /* The page keeps the swap frame it came from */
+       swptyp = fp->swptyp;
+       swpfpn = swpslot - 1;
+     } else if (swap_get_slot(vmm, vicpgn, mswp, &swptyp, &swpfpn) < 0) {
+       /* Swap is full, the victim stays where it is */
+       MEMPHY_set_owner(mram, vicfpn, vmm, vicpgn);
+       pgring_push(&vmm->pgring, vicpgn);
+       return -1;
+     }
+ 
+     if (*pte & PAGING_PTE_DIRTY_MASK) {
+       printf("[DBG]   swap victim pid=%d pgn=%d (fpn=%d) ↔ swpfpn=%d\n",
+              vmm->pid, vicpgn, vicfpn, swpfpn);
+       if (caller != NULL) {
+         struct sc_regs regs;
+         regs.a1 = SYSMEM_SWP_OP; regs.a2 = vicfpn; regs.a3 = swpfpn;
+         regs.a4 = swptyp;
+         syscall(caller, 17, &regs);
+       } else {
+         int cost = __swap_cp_page(mram, vicfpn, &mswp[swptyp], swpfpn);
+         if (cost > 0)
+           *stall += cost;
+       }
+       __sync_fetch_and_add(&mm_stat.swap_outs, 1);
+       __sync_fetch_and_add(&mm_stat.swap_outs_dev[swptyp], 1);
+     } else {
+       /* Clean: the swap copy is still up to date */
+       __sync_fetch_and_add(&mm_stat.clean_drops, 1);
+     }
+ 
+     CLRBIT_ATOMIC(*pte, PAGING_PTE_DIRTY_MASK);
+     pte_set_swap(pte, swptyp, swpfpn);
+     MEMPHY_set_owner(&mswp[swptyp], swpfpn, vmm, vicpgn);
+   }
+   fp->swpslot = 0;
+   fp->swptyp = 0;
+   __sync_fetch_and_sub(&vmm->rss, 1);
+   __sync_fetch_and_add(&mm_stat.evictions, 1);
+   return 0;
+ }
+ 
+ /*mm_evict_frame - free a RAM frame by swapping a page out
+  *@caller: faulting process, which gets the frame
+  *@retfpn: the frame
+  *
+  *In local scope the victim is the oldest page of @caller. In global
+  *scope it is the oldest page in MEMRAM, skipping processes that are
+  *down to MM_RSS_FLOOR resident pages. Called with the lock of @caller
+  *held; in global scope the victim comes with the lock of its owner,
+  *released here once the page is out. Every call is a direct reclaim
+  *stall, which kswapd is there to avoid.
+  */
+ int mm_evict_frame(struct pcb_t *caller, int *retfpn)
+ {
+   struct mm_struct *vmm;
+   int vicpgn, vicfpn;
+   int ret;
+ 
+   __sync_fetch_and_add(&mm_stat.direct, 1);
+   if (mm_replace_scope == MM_REPLACE_GLOBAL) {
+     struct timespec wait = { 0, 100000 };
+     int try = 0;
+ 
+     /* Every frame may belong to processes busy on other CPUs */
+     while (MEMPHY_pick_victim(caller->mram, caller->mm, MM_RSS_FLOOR,
+                               mm_replace_policy, &vicfpn, &vmm,
+                               &vicpgn) < 0) {
+       if (++try > MM_EVICT_RETRY)
+         return -1;
+       nanosleep(&wait, NULL);
+     }
+     pgring_remove(&vmm->pgring, vicpgn);
+   } else {
+     vmm = caller->mm;
+     if (find_victim_page(vmm, &vicpgn) < 0)
+       return -1;
+     vicfpn = PAGING_FPN(*pte_lookup(vmm, vicpgn));
+     MEMPHY_set_owner(caller->mram, vicfpn, NULL, -1);
+     MEMPHY_get_frame(caller->mram, vicfpn)->busy = 1;
+   }
+ 
+   ret = swap_out_page(caller, caller->mram, caller->mswp, vmm,
+                       vicpgn, vicfpn, NULL);
+   if (ret == 0)
+     *retfpn = vicfpn;
+ 
+   if (mm_replace_scope == MM_REPLACE_GLOBAL)
+     pthread_mutex_unlock(&vmm->lock);
+   return ret;
+ }
+ 
+ /*mm_kswapd - one time slot of background reclaim
+  *@mram: RAM to keep free frames in
+  *@mswp: swap devices taking the pages
+  *@stall: device latency of the writes, added to it
+  *
+  *kswapd wakes up when fewer than the low watermark of frames are
+  *free, and evicts up to MM_KSWAPD_BATCH pages per slot, oldest first
+  *whatever the replacement scope, until the high watermark is reached.
+  *It never pushes a process below MM_RSS_FLOOR resident pages, and
+  *skips processes in the middle of a memory operation. Under global
+  *AGING it first ages the frames of @mram, awake or not. Returns the
+  *number of pages evicted.
+  */
+ int mm_kswapd(struct memphy_struct *mram, struct memphy_struct *mswp,
+               uint32_t *stall)
+ {
+   static int awake = 0; /* There is a single kswapd */
+   struct mm_struct *vmm;
+   int vicpgn, vicfpn, ret;
+   int n = 0;
+ 
+   if (mm_replace_scope == MM_REPLACE_GLOBAL &&
+       mm_replace_policy == MM_POLICY_AGING)
+     MEMPHY_age_frames(mram);
+ 
+   if (!awake) {
+     if (MEMPHY_nr_free(mram) >= mm_wmark_low)
+       return 0;
+     awake = 1;
+     __sync_fetch_and_add(&mm_stat.kswapd_wakes, 1);
+   }
+ 
+   while (n < MM_KSWAPD_BATCH && MEMPHY_nr_free(mram) < mm_wmark_high) {
+     if (MEMPHY_pick_victim(mram, NULL, MM_RSS_FLOOR, mm_replace_policy,
+                            &vicfpn, &vmm, &vicpgn) < 0)
+       break;
+     pgring_remove(&vmm->pgring, vicpgn);
+     ret = swap_out_page(NULL, mram, mswp, vmm, vicpgn, vicfpn, stall);
+     if (ret == 0)
+       MEMPHY_put_freefp(mram, vicfpn);
+     pthread_mutex_unlock(&vmm->lock);
+     if (ret < 0)
+       break;
+     n++;
+   }
+   __sync_fetch_and_add(&mm_stat.kswapd_pages, n);
+   if (MEMPHY_nr_free(mram) >= mm_wmark_high)
+     awake = 0;
+   return n;
+ }
+ 
+ /*swap_readahead - read in the pages swapped next to a faulted one
+  *@mm: faulting mm, locked
+  *@caller: faulting process, which pays for the reads
+  *@swptyp, @swpfpn: swap device and frame just read
+  *
+  *Pages of @mm following @swpfpn in its swap cluster are read into free
+  *RAM frames, never evicting and never below the low watermark of
+  *kswapd. The window doubles while read ahead pages get accessed before
+  *the next swap-in and halves when none was. Read ahead pages are left
+  *not accessed, so replacement takes them first if they stay unused.
+  */
+ static void swap_readahead(struct mm_struct *mm, struct pcb_t *caller,
+                            int swptyp, int swpfpn)
+ {
+   struct memphy_struct *mswp = &caller->mswp[swptyp];
+   struct framephy_struct *sfp, *fp;
+   int end = (swpfpn | (MM_SWAP_CLUSTER - 1)) + 1;
+   int slot, fpn, pgn, cost, n = 0;
+   uint32_t *ptep;
+ 
+   if (mm->ra_hits > 0)
+     mm->ra_win = mm->ra_win * 2 < MM_SWAP_RA_MAX ? mm->ra_win * 2
+                                                  : MM_SWAP_RA_MAX;
+   else if (mm->ra_win > 1)
+     mm->ra_win /= 2;
+   mm->ra_hits = 0;
+ 
+   for (slot = swpfpn + 1; slot < end && n < mm->ra_win; slot++) {
+     /* Slots of @mm only change under its lock */
+     sfp = MEMPHY_get_frame(mswp, slot);
+     if (sfp == NULL ||
+         __atomic_load_n(&sfp->owner, __ATOMIC_RELAXED) != mm)
+       continue;
+     pgn = sfp->pgn;
+     ptep = pte_lookup(mm, pgn);
+     if (ptep == NULL || PAGING_PAGE_PRESENT(*ptep) ||
+         !(*ptep & PAGING_PTE_SWAPPED_MASK) ||
+         PAGING_PTE_SWPTYP(*ptep) != swptyp || PAGING_PTE_SWP(*ptep) != slot)
+       continue;
+     if (MEMPHY_nr_free(caller->mram) <= mm_wmark_low ||
+         MEMPHY_get_freefp(caller->mram, &fpn) < 0)
+       break;
+ 
+     fp = MEMPHY_get_frame(caller->mram, fpn);
+     fp->busy = 1;
+     cost = __swap_cp_page(mswp, slot, caller->mram, fpn);
+     if (cost > 0)
+       caller->io_stall += cost;
+     fp->swpslot = slot + 1;
+     fp->swptyp = swptyp;
+     *ptep = 0;
+     pte_set_fpn(ptep, fpn);
+     MEMPHY_set_owner(caller->mram, fpn, mm, pgn);
+     fp->ra = 1;
+     pgring_push(&mm->pgring, pgn);
+     __sync_fetch_and_add(&mm->rss, 1);
+     n++;
+   }
+   __sync_fetch_and_add(&mm_stat.ra_pages, n);
  }
  
  /*pg_getpage - get the page in ram
@@ -178,37 +1196,72 @@ int __alloc(struct pcb_t *caller,int vmaid,int rgid,
 int pg_getpage(struct mm_struct *mm, int pgn, int *fpn,
                struct pcb_t *caller)
 {
-  uint32_t pte = mm->pgd[pgn];
+  uint32_t *ptep = pte_lookup(mm, pgn);
+  uint32_t pte = ptep ? *ptep : 0;
   printf("[DBG] pg_getpage pid=%d pgn=%d\n", caller->pid, pgn);
+  __sync_fetch_and_add(&mm_stat.accesses, 1);
 
   if (!PAGING_PAGE_PRESENT(pte)) {
     printf("[DBG]   page fault!\n");
 
-    int vicpgn, swpfpn;
-    find_victim_page(caller->mm, &vicpgn);
-    uint32_t vicpte = mm->pgd[vicpgn];
-    int vicfpn = PAGING_FPN(vicpte);
+    /* A page that is neither present, swapped nor reserved was never
+     * allocated */
+    if (!(pte & (PAGING_PTE_SWAPPED_MASK | PAGING_PTE_RESERVE_MASK)))
+      return -1;
 
-    MEMPHY_get_freefp(caller->active_mswp, &swpfpn);
-    printf("[DBG]   swap victim pgn=%d (fpn=%d) ↔ swpfpn=%d\n",
-           vicpgn, vicfpn, swpfpn);
+    int vicfpn, swptyp = 0, swpin = -1;
 
-    struct sc_regs regs;
-    regs.a1 = SYSMEM_SWP_OP; regs.a2 = vicpgn; regs.a3 = swpfpn;
-    syscall(caller, 17, &regs);
+    /* RAM is full: swap a victim out to make room */
+    if (MEMPHY_get_freefp(caller->mram, &vicfpn) < 0 &&
+        mm_evict_frame(caller, &vicfpn) < 0)
+      return -1;
+    /* Off limits to eviction until mapped */
+    MEMPHY_get_frame(caller->mram, vicfpn)->busy = 1;
 
-    int tgtfpn = PAGING_PTE_SWP(pte);
-    regs.a1 = SYSMEM_SWP_OP; regs.a2 = pgn;
-    regs.a3 = vicfpn;
-    syscall(caller, 17, &regs);
+    if (pte & PAGING_PTE_SWAPPED_MASK) {
+      int tgttyp = PAGING_PTE_SWPTYP(pte);
+      int tgtfpn = PAGING_PTE_SWP(pte);
+
+      /* Bring the target page in. Its swap frame stays allocated as
+       * a copy, so a clean eviction later needs no write back */
+      __sync_fetch_and_add(&mm_stat.faults, 1);
+      int cost = __swap_cp_page(&caller->mswp[tgttyp], tgtfpn,
+                                caller->mram, vicfpn);
+      if (cost > 0)
+        caller->io_stall += cost;
+      MEMPHY_get_frame(caller->mram, vicfpn)->swpslot = tgtfpn + 1;
+      MEMPHY_get_frame(caller->mram, vicfpn)->swptyp = tgttyp;
+      swptyp = tgttyp;
+      swpin = tgtfpn;
+    } else {
+      /* First touch of a reserved page */
+      static const BYTE zero_page[PAGING_PAGESZ];
+
+      __sync_fetch_and_add(&mm_stat.zero_fills, 1);
+      MEMPHY_write_block(caller->mram, vicfpn * PAGING_PAGESZ, zero_page,
+                         PAGING_PAGESZ);
+    }
 
-    pte_set_swap(&mm->pgd[vicpgn], 0, swpfpn);
-    mm->pgd[pgn] = 0;
-    pte_set_fpn(&mm->pgd[pgn], vicfpn);
-    enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
+    *ptep = 0;
+    pte_set_fpn(ptep, vicfpn);
+    MEMPHY_set_owner(caller->mram, vicfpn, mm, pgn);
+    pgring_push(&mm->pgring, pgn);
+    __sync_fetch_and_add(&mm->rss, 1);
+    if (swpin >= 0 && MM_SWAP_RA_MAX > 0)
+      swap_readahead(mm, caller, swptyp, swpin);
+  } else {
+    struct framephy_struct *fp = MEMPHY_get_frame(caller->mram,
+                                                  PAGING_FPN(pte));
+    if (fp->ra) {
+      /* First access of a read ahead page */
+      fp->ra = 0;
+      mm->ra_hits++;
+      __sync_fetch_and_add(&mm_stat.ra_hits, 1);
+    }
   }
 
-  *fpn = PAGING_FPN(mm->pgd[pgn]);
+  SETBIT_ATOMIC(*ptep, PAGING_PTE_ACCESSED_MASK);
+  *fpn = PAGING_FPN(*ptep);
   printf("[DBG]   hit fpn=%d\n", *fpn);
   return 0;
 }
@@ -267,6 +1320,7 @@ int pg_setval(struct mm_struct *mm,
 
     if (pg_getpage(mm, pgn, &fpn, caller) != 0)
         return -1;
+    SETBIT_ATOMIC(*pte_lookup(mm, pgn), PAGING_PTE_DIRTY_MASK);
 
     int off     = PAGING_OFFST(vaddr);
     int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
@@ -345,7 +1399,11 @@ int libread(struct pcb_t *proc,
             uint32_t  *dst)
 {
     BYTE val = 0;
+    pthread_mutex_lock(&proc->mm->lock);
     int  rc  = __read(proc, 0, region_id, offset, &val);
+    if (mm_check_on)
+        mm_check(proc);
+    pthread_mutex_unlock(&proc->mm->lock);
 
     if (rc == 0) {
         *dst = (uint32_t)val;
@@ -391,6 +1449,7 @@ int libread(struct pcb_t *proc,
      uint32_t destination, // Index of destination register
      uint32_t offset)
  {
+   pthread_mutex_lock(&proc->mm->lock);
  #ifdef IODUMP
    printf("write region=%d offset=%d value=%d\n", destination, offset, data);
  #ifdef PAGETBL_DUMP
@@ -399,7 +1458,11 @@ int libread(struct pcb_t *proc,
    MEMPHY_dump(proc->mram);
  #endif
  
-   return __write(proc, 0, destination, offset, data);
+   int ret = __write(proc, 0, destination, offset, data);
+   if (mm_check_on)
+     mm_check(proc);
+   pthread_mutex_unlock(&proc->mm->lock);
+   return ret;
  }
  
  /*free_pcb_memphy - collect all memphy of pcb
@@ -410,43 +1473,192 @@ int libread(struct pcb_t *proc,
  int free_pcb_memph(struct pcb_t *caller)
  {
    int pagenum, fpn;
-   uint32_t pte;
+   uint32_t *ptep, pte;
  
  
-   for(pagenum = 0; pagenum < PAGING_MAX_PGN; pagenum++)
+   /* Freeing a frame also drops it from the frame table. Only the
+    * populated parts of the page table are walked */
+   for(pagenum = 0; (ptep = pte_next(caller->mm, &pagenum)) != NULL; pagenum++)
    {
-     pte= caller->mm->pgd[pagenum];
+     pte = *ptep;
  
-     if (!PAGING_PAGE_PRESENT(pte))
+     if (PAGING_PAGE_PRESENT(pte))
      {
        fpn = PAGING_PTE_FPN(pte);
+       /* A page swapped in earlier may still have its swap copy */
+       struct framephy_struct *fp = MEMPHY_get_frame(caller->mram, fpn);
+       if (fp != NULL && fp->swpslot > 0)
+         MEMPHY_put_freefp(&caller->mswp[fp->swptyp], fp->swpslot - 1);
        MEMPHY_put_freefp(caller->mram, fpn);
-     } else {
+     } else if (pte & PAGING_PTE_SWAPPED_MASK) {
        fpn = PAGING_PTE_SWP(pte);
-       MEMPHY_put_freefp(caller->active_mswp, fpn);    
+       MEMPHY_put_freefp(&caller->mswp[PAGING_PTE_SWPTYP(pte)], fpn);
      }
    }
+   caller->mm->rss = 0;
  
    return 0;
  }
  
+ /*free_mm - release the memory of an exiting process
+  *@caller: caller
+  *
+  *Frames and swap frames go back first, under the lock of the mm, as a
+  *fault on another CPU may be taking one of them. Once the process owns
+  *no frame, no other thread can reach the mm, so the page table, areas,
+  *regions and the mm itself go without it. The page table walk only
+  *visits populated leaves.
+  */
+ int free_mm(struct pcb_t *caller)
+ {
+   struct mm_struct *mm = caller->mm;
+   struct vm_area_struct *vma, *next;
+   struct vm_rg_struct *rg, *next_rg;
+ 
+   if (mm == NULL)
+     return 0;
+ 
+   pthread_mutex_lock(&mm->lock);
+   free_pcb_memph(caller);
+   pthread_mutex_unlock(&mm->lock);
+ 
+   pt_free(mm);
+   for (vma = mm->mmap; vma != NULL; vma = next) {
+     next = vma->vm_next;
+     /* Unused end of the swap cluster */
+     while (vma->swp_next < vma->swp_end)
+       MEMPHY_put_freefp(&caller->mswp[vma->swp_type], vma->swp_next++);
+     for (rg = vma->vm_freerg_list; rg != NULL; rg = next_rg) {
+       next_rg = rg->rg_next;
+       free(rg);
+     }
+     free(vma);
+   }
+   pgring_free(&mm->pgring);
+   mm_slab_release(mm);
+   free_symrg_table(mm);
+   pthread_mutex_destroy(&mm->lock);
+   free(mm);
+   caller->mm = NULL;
+ 
+   return 0;
+ }
+ 
+ /*mm_check - check the paging state of a process
+  *@caller: process, whose lock is held
+  *
+  *Each present page must own its frame, each swapped page its swap
+  *frame, and the resident pages must match the rss and the page ring.
+  *Returns the number of broken invariants, printed as they are found.
+  */
+ int mm_check(struct pcb_t *caller)
+ {
+   struct mm_struct *mm = caller->mm;
+   struct framephy_struct *fp;
+   uint32_t *ptep, pte;
+   int pgn, present = 0, bad = 0;
+ 
+   for (pgn = 0; (ptep = pte_next(mm, &pgn)) != NULL; pgn++) {
+     pte = *ptep;
+     if (PAGING_PAGE_PRESENT(pte)) {
+       present++;
+       fp = MEMPHY_get_frame(caller->mram, PAGING_PTE_FPN(pte));
+     } else if (pte & PAGING_PTE_SWAPPED_MASK) {
+       fp = MEMPHY_get_frame(&caller->mswp[PAGING_PTE_SWPTYP(pte)],
+                             PAGING_PTE_SWP(pte));
+     } else {
+       continue;
+     }
+     if (fp == NULL || fp->owner != mm || fp->pgn != pgn || fp->busy) {
+       printf("mm_check: pid=%d pgn=%d pte=%08x not backed by its frame\n",
+              mm->pid, pgn, pte);
+       bad++;
+     }
+   }
+ 
+   if (present != mm->rss || present != mm->pgring.count - mm->pgring.holes) {
+     printf("mm_check: pid=%d %d pages present, rss %d, ring %d\n",
+            mm->pid, present, mm->rss, mm->pgring.count - mm->pgring.holes);
+     bad++;
+   }
+ 
+   __sync_fetch_and_add(&heap_stat.checks, 1);
+   __sync_fetch_and_add(&heap_stat.check_errs, bad);
+   return bad;
+ }
  
  /*find_victim_page - find victim page
   *@caller: caller
   *@pgn: return page number
   *
+  *Picks among the resident pages of @mm by the replacement policy and
+  *drops the victim from the ring.
   */
  int find_victim_page(struct mm_struct *mm, int *retpgn)
  {
-   struct pgn_t *pg = mm->fifo_pgn;
+   struct pg_ring *r = &mm->pgring;
+   int i, slot, best, pgn;
+   uint32_t *pte;
  
-   /* TODO: Implement the theorical mechanism to find the victim page */
-   if(pg == NULL){
+   if (r->count == 0)
      return -1;
+ 
+   switch (mm_replace_policy) {
+   case MM_POLICY_SECOND:
+     /* The head is never a hole; an accessed head goes to the tail */
+     for (i = 0; i < r->count; i++) {
+       pgn = r->pgn[r->head];
+       pte = pte_lookup(mm, pgn);
+       if (!PAGING_PAGE_ACCESSED(*pte))
+         break;
+       CLRBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+       pgring_remove(r, pgn);
+       pgring_push(r, pgn);
+     }
+     slot = r->head;
+     break;
+ 
+   case MM_POLICY_CLOCK:
+     /* Two sweeps at most: the first one clears every accessed bit */
+     for (i = 0; i < 2 * r->count; i++, r->hand++) {
+       if (r->hand >= r->count)
+         r->hand = 0;
+       slot = (r->head + r->hand) % r->cap;
+       if (r->pgn[slot] < 0)
+         continue;
+       pte = pte_lookup(mm, r->pgn[slot]);
+       if (!PAGING_PAGE_ACCESSED(*pte))
+         break;
+       CLRBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+     }
+     if (i == 2 * r->count)
+       slot = r->head;
+     break;
+ 
+   case MM_POLICY_AGING:
+     /* Age every page once per fault, the oldest lowest counter loses */
+     best = -1;
+     for (i = 0; i < r->count; i++) {
+       slot = (r->head + i) % r->cap;
+       if (r->pgn[slot] < 0)
+         continue;
+       pte = pte_lookup(mm, r->pgn[slot]);
+       r->age[slot] = (r->age[slot] >> 1) |
+                      (PAGING_PAGE_ACCESSED(*pte) ? 0x80 : 0);
+       CLRBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+       if (best < 0 || r->age[slot] < r->age[best])
+         best = slot;
+     }
+     slot = best;
+     break;
+ 
+   default:
+     slot = r->head;
+     break;
    }
-   *retpgn = pg->pgn;
-   mm->fifo_pgn = pg->pg_next;
-   free(pg);
+ 
+   *retpgn = r->pgn[slot];
+   pgring_remove(r, *retpgn);
  
    return 0;
  }
@@ -465,35 +1677,42 @@ int get_free_vmrg_area(struct pcb_t *caller,
     struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
     if (!cur_vma || !newrg) return -1;
 
-    struct vm_rg_struct *prev = NULL;
-    struct vm_rg_struct *rg   = cur_vma->vm_freerg_list;
+    struct vm_rg_struct *rg, *best = NULL;
+    uint32_t bins;
+    int b;
 
     newrg->rg_start = newrg->rg_end = -1;
+    if (size <= 0) return -1;
 
-    while (rg) {
-        int hole_size = rg->rg_end - rg->rg_start;
-        if (hole_size >= size) {
-            /* carve the space */
-            newrg->rg_start = rg->rg_start;
-            newrg->rg_end   = rg->rg_start + size;
-            rg->rg_start   += size;
-
-            /* if the hole is now empty just unlink it (DON’T free) */
-            if (rg->rg_start >= rg->rg_end) {
-                if (prev) prev->rg_next = rg->rg_next;
-                else      cur_vma->vm_freerg_list = rg->rg_next;
-                /* keep the node for reuse or free here if you allocated it
-                   with malloc in inc_vma_limit – never free symrgtbl nodes */
-            }
-            printf("[DBG]   take [%ld..%ld) remain=%d\n",
-                   newrg->rg_start, newrg->rg_end,
-                   rg->rg_end - rg->rg_start);
-            return 0;
-        }
-        prev = rg;
-        rg   = rg->rg_next;
+    /* best fit in the bin of the request, which may hold smaller holes */
+    b = freerg_bin(size);
+    for (rg = cur_vma->vm_freebins[b]; rg; rg = rg->bin_next) {
+        unsigned long hole_size = rg->rg_end - rg->rg_start;
+        if (hole_size >= (unsigned long)size &&
+            (!best || hole_size < best->rg_end - best->rg_start))
+            best = rg;
+    }
+
+    /* otherwise any hole of the next non-empty bin fits, take the
+     * smallest of them                                               */
+    bins = b + 1 < VM_FREEBIN_NR ? cur_vma->vm_freebin_map & ~(BIT(b + 1) - 1) : 0;
+    if (!best && bins) {
+        for (rg = cur_vma->vm_freebins[__builtin_ctz(bins)]; rg; rg = rg->bin_next)
+            if (!best || rg->rg_end - rg->rg_start < best->rg_end - best->rg_start)
+                best = rg;
     }
-    return -1;          /* no hole fits */
+    if (!best) return -1;          /* no hole fits */
+
+    /* carve the space from the bottom of the hole */
+    newrg->rg_start = best->rg_start;
+    newrg->rg_end   = best->rg_start + size;
+    newrg->rg_next  = newrg->rg_prev = NULL;
+    newrg->bin_next = newrg->bin_prev = NULL;
+    newrg->rg_slab  = NULL;
+    printf("[DBG]   take [%ld..%ld) remain=%ld\n",
+           newrg->rg_start, newrg->rg_end, best->rg_end - newrg->rg_end);
+    resize_vm_freerg(cur_vma, best, newrg->rg_end, best->rg_end);
+    return 0;
 }
 
 
@@ -1,11 +1,31 @@
 
 #include "loader.h"
+#include "bitops.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 static uint32_t avail_pid = 1;
 
+/* Program cache: every code segment in use, hashed by program path */
+#define PROG_CACHE_SZ	64
+
+struct prog_t {
+	char path[100];
+	uint32_t priority;
+	struct code_seg_t code;
+	struct prog_t * next;
+};
+
+static struct prog_t * prog_cache[PROG_CACHE_SZ];
+static pthread_mutex_t prog_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define OPT_CALC	"calc"
 #define OPT_ALLOC	"alloc"
 #define OPT_FREE	"free"
@@ -32,65 +52,61 @@ static enum ins_opcode_t get_opcode(char * opt) {
 	}
 }
 
-struct pcb_t * load(const char * path) {
-	/* Create new PCB for the new process */
-	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
-	proc->pid = avail_pid;
-	avail_pid++;
-	proc->page_table =
-		(struct page_table_t*)malloc(sizeof(struct page_table_t));
-	proc->bp = PAGE_SIZE;
-	proc->pc = 0;
-
-	/* Read process code from file */
+/* Parse the text program at [path] into [code]. Return -1 if there is
+ * no such program */
+static int load_text(const char * path, uint32_t * priority,
+		struct code_seg_t * code) {
 	FILE * file;
 	if ((file = fopen(path, "r")) == NULL) {
 		printf("Cannot find process description at '%s'\n", path);
-		exit(1);		
+		return -1;
 	}
-	snprintf(proc->path, 2*sizeof(path)+1, "%s", path);
 	char opcode[10];
-	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
-	fscanf(file, "%u %u", &proc->priority, &proc->code->size);
-	proc->code->text = (struct inst_t*)malloc(
-		sizeof(struct inst_t) * proc->code->size
+	fscanf(file, "%u %u", priority, &code->size);
+	code->text = (struct inst_t*)aligned_alloc(IMG_ALIGN,
+		DIV_ROUND_UP(sizeof(struct inst_t) * code->size + 1, IMG_ALIGN)
+			* IMG_ALIGN
 	);
+	code->map = NULL;
+	code->mapsz = 0;
 	uint32_t i = 0;
 	char buf[200];
-	for (i = 0; i < proc->code->size; i++) {
+	for (i = 0; i < code->size; i++) {
 		fscanf(file, "%s", opcode);
-		proc->code->text[i].opcode = get_opcode(opcode);
-		switch(proc->code->text[i].opcode) {
+		memset(&code->text[i], 0, sizeof(struct inst_t));
+		code->text[i].opcode = get_opcode(opcode);
+		switch(code->text[i].opcode) {
 		case CALC:
 			break;
 		case ALLOC:
-			fscanf(
-				file,
-				"%u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1
+			/* size, region and optional PAGING_ALLOC_* flags */
+			fgets(buf, sizeof(buf), file);
+			sscanf(buf, "%u %u %u",
+			           &code->text[i].arg_0,
+			           &code->text[i].arg_1,
+			           &code->text[i].arg_2
 			);
 			break;
 		case FREE:
-			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
+			fscanf(file, "%u\n", &code->text[i].arg_0);
 			break;
 		case READ:
 		case WRITE:
 			fscanf(
 				file,
 				"%u %u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1,
-				&proc->code->text[i].arg_2
+				&code->text[i].arg_0,
+				&code->text[i].arg_1,
+				&code->text[i].arg_2
 			);
-			break;	
+			break;
 		case SYSCALL:
 			fgets(buf, sizeof(buf), file);
 			sscanf(buf, "%d%d%d%d",
-			           &proc->code->text[i].arg_0,
-			           &proc->code->text[i].arg_1,
-			           &proc->code->text[i].arg_2,
-			           &proc->code->text[i].arg_3
+			           &code->text[i].arg_0,
+			           &code->text[i].arg_1,
+			           &code->text[i].arg_2,
+			           &code->text[i].arg_3
 			);
 			break;
 		default:
@@ -98,8 +114,234 @@ struct pcb_t * load(const char * path) {
 			exit(1);
 		}
 	}
-	return proc;
+	fclose(file);
+	return 0;
+}
+
+/* Modification time of [path] in ns, 0 if it cannot be read */
+static uint64_t get_mtime(const char * path) {
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return 0;
+	return (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
 }
 
+/* Map the image at [path] into [code]. Return 0 if [path] is a valid
+ * image and, when [mtime] is not 0, was built from a source with that
+ * mtime. Otherwise, return -1 and leave [code] untouched */
+static int load_image(const char * path, uint64_t mtime,
+		uint32_t * priority, struct code_seg_t * code) {
+	struct stat st;
+	struct img_hdr_t * hdr;
+	int fd;
 
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct img_hdr_t)) {
+		close(fd);
+		return -1;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return -1;
+
+	if (hdr->magic != IMG_MAGIC || hdr->version != IMG_VERSION ||
+	    hdr->inst_sz != sizeof(struct inst_t) ||
+	    (mtime != 0 && hdr->src_mtime != mtime) ||
+	    st.st_size != (off_t)(sizeof(struct img_hdr_t) +
+				hdr->size * sizeof(struct inst_t))) {
+		munmap(hdr, st.st_size);
+		return -1;
+	}
+
+	*priority = hdr->priority;
+	code->size = hdr->size;
+	code->text = (struct inst_t *)(hdr + 1);
+	code->map = hdr;
+	code->mapsz = st.st_size;
+	return 0;
+}
+
+/* Write [code] as an image to [dst]. The image is built under a
+ * temporary name and renamed, so concurrent loaders never map a
+ * partially written file */
+static int write_image(const char * dst, uint64_t mtime,
+		uint32_t priority, struct code_seg_t * code) {
+	struct img_hdr_t hdr;
+	char tmp[256];
+	FILE * file;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", dst, (int)getpid());
+	if ((file = fopen(tmp, "wb")) == NULL)
+		return -1;
+
+	hdr.magic = IMG_MAGIC;
+	hdr.version = IMG_VERSION;
+	hdr.inst_sz = sizeof(struct inst_t);
+	hdr.priority = priority;
+	hdr.size = code->size;
+	hdr.src_mtime = mtime;
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+	    fwrite(code->text, sizeof(struct inst_t), code->size, file)
+			!= code->size) {
+		fclose(file);
+		unlink(tmp);
+		return -1;
+	}
+	if (fclose(file) != 0 || rename(tmp, dst) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+int compile_image(const char * src, const char * dst) {
+	struct code_seg_t code;
+	uint32_t priority;
+	int ret;
+
+	if (load_image(src, 0, &priority, &code) == 0) {
+		/* Already an image, just copy it */
+		ret = write_image(dst, ((struct img_hdr_t *)code.map)->src_mtime,
+				priority, &code);
+		munmap(code.map, code.mapsz);
+		return ret;
+	}
+	if (load_text(src, &priority, &code) < 0)
+		return -1;
+	ret = write_image(dst, get_mtime(src), priority, &code);
+	free(code.text);
+	return ret;
+}
+
+/* Release the instruction array of a code segment */
+static void free_code(struct code_seg_t * code) {
+	if (code->map != NULL)
+		munmap(code->map, code->mapsz);
+	else
+		free(code->text);
+}
+
+/* Fill [code] from [path], going through the image cache if enabled.
+ * Return -1 if there is no such program */
+static int load_code(const char * path, uint32_t * priority,
+		struct code_seg_t * code) {
+	/* The program itself may be a precompiled image */
+	if (load_image(path, 0, priority, code) == 0)
+		return 0;
+
+#ifdef LOADER_IMG_CACHE
+	/* Otherwise try the cached image next to the source, which is
+	 * keyed on the source mtime it was built from */
+	char img[256];
+	uint64_t mtime = get_mtime(path);
+
+	snprintf(img, sizeof(img), "%s%s", path, IMG_SUFFIX);
+	if (mtime != 0 && load_image(img, mtime, priority, code) == 0)
+		return 0;
+
+	if (load_text(path, priority, code) < 0)
+		return -1;
+	/* A read-only input directory just means no caching */
+	if (mtime != 0)
+		write_image(img, mtime, *priority, code);
+	return 0;
+#else
+	return load_text(path, priority, code);
+#endif
+}
+
+static uint32_t hash_path(const char * path) {
+	uint32_t h = 2166136261u;	/* FNV-1a */
+
+	while (*path)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h % PROG_CACHE_SZ;
+}
+
+/* Get a reference to the code segment of [path], loading it on a miss.
+ * Return NULL if there is no such program */
+static struct code_seg_t * get_code(const char * path, uint32_t * priority) {
+	struct prog_t ** bucket = &prog_cache[hash_path(path)];
+	struct prog_t * prog;
+
+	pthread_mutex_lock(&prog_lock);
+	for (prog = *bucket; prog != NULL; prog = prog->next) {
+		if (!strcmp(prog->path, path)) {
+			prog->code.refcnt++;
+			*priority = prog->priority;
+			pthread_mutex_unlock(&prog_lock);
+			return &prog->code;
+		}
+	}
+
+	/* Loading under the lock keeps one copy per path even when
+	 * several loaders miss at the same time */
+	prog = (struct prog_t *)malloc(sizeof(struct prog_t));
+	snprintf(prog->path, sizeof(prog->path), "%s", path);
+	if (load_code(path, &prog->priority, &prog->code) < 0) {
+		pthread_mutex_unlock(&prog_lock);
+		free(prog);
+		return NULL;
+	}
+	prog->code.refcnt = 1;
+	prog->next = *bucket;
+	*bucket = prog;
+	*priority = prog->priority;
+	pthread_mutex_unlock(&prog_lock);
+	return &prog->code;
+}
+
+void put_code(struct code_seg_t * code) {
+	struct prog_t * prog;
+	struct prog_t ** it;
+
+	if (code == NULL)
+		return;
+
+	prog = (struct prog_t *)((char *)code - offsetof(struct prog_t, code));
+	pthread_mutex_lock(&prog_lock);
+	if (--code->refcnt > 0) {
+		pthread_mutex_unlock(&prog_lock);
+		return;
+	}
+	for (it = &prog_cache[hash_path(prog->path)]; *it != prog;
+			it = &(*it)->next)
+		;
+	*it = prog->next;
+	pthread_mutex_unlock(&prog_lock);
+	free_code(code);
+	free(prog);
+}
+
+uint32_t alloc_pid(void) {
+	return __sync_fetch_and_add(&avail_pid, 1);
+}
+
+struct pcb_t * load(const char * path) {
+	return load_pid(path, alloc_pid());
+}
+
+struct pcb_t * load_pid(const char * path, uint32_t pid) {
+	/* Create new PCB for the new process */
+	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
+	proc->pid = pid;
+	proc->page_table =
+		(struct page_table_t*)calloc(1, sizeof(struct page_table_t));
+	proc->bp = PAGE_SIZE;
+	proc->pc = 0;
+	proc->killed = 0;
+
+	/* Share the code of every process running the same program */
+	snprintf(proc->path, sizeof(proc->path), "%s", path);
+	proc->code = get_code(path, &proc->priority);
+	if (proc->code == NULL) {
+		free(proc->page_table);
+		free(proc);
+		return NULL;
+	}
+	return proc;
+}
 
@@ -5,26 +5,35 @@
  */
 
  #include "mm.h"
+ #include "timer.h"
  #include <stdio.h>
  #include <stdlib.h>
+ #include <string.h>
+ #include <pthread.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <unistd.h>
+ #include <sys/mman.h>
  
  /*
   *  MEMPHY_mv_csr - move MEMPHY cursor
   *  @mp: memphy struct
   *  @offset: offset
+  *
+  *  Returns the distance travelled by the cursor.
   */
  int MEMPHY_mv_csr(struct memphy_struct *mp, int offset)
  {
-    int numstep = 0;
+    int dist;
  
-    mp->cursor = 0;
-    while (numstep < offset && numstep < mp->maxsz) {
-      /* Traverse sequentially */
-      mp->cursor = (mp->cursor + 1) % mp->maxsz;
-      numstep++;
-    }
+    /* Offsets past the device wrap back to its start */
+    if (offset < 0 || offset >= mp->maxsz)
+      offset = 0;
  
-    return 0;
+    dist = offset - mp->cursor;
+    mp->cursor = offset;
+ 
+    return dist < 0 ? -dist : dist;
  }
  
  /*
@@ -38,11 +47,13 @@
     if (mp == NULL)
       return -1;
  
-    if (!mp->rdmflg)
+    if (mp->rdmflg)
       return -1; /* Not compatible mode for sequential read */
  
+    pthread_mutex_lock(&mp->io_lock);
     MEMPHY_mv_csr(mp, addr);
     *value = (BYTE) mp->storage[addr];
+    pthread_mutex_unlock(&mp->io_lock);
  
     return 0;
  }
@@ -76,11 +87,13 @@
     if (mp == NULL)
       return -1;
  
-    if (!mp->rdmflg)
+    if (mp->rdmflg)
       return -1; /* Not compatible mode for sequential write */
  
+    pthread_mutex_lock(&mp->io_lock);
     MEMPHY_mv_csr(mp, addr);
     mp->storage[addr] = value;
+    pthread_mutex_unlock(&mp->io_lock);
  
     return 0;
  }
@@ -101,86 +114,943 @@
    return 0;
  }
  
+ /*
+  *  MEMPHY_seq_xfer - position a sequential device for a transfer
+  *  @mp: memphy struct
+  *  @addr: first address of the transfer
+  *  @len: transfer length
+  *
+  *  Returns the modeled latency of the transfer, in MEMPHY cost units:
+  *  a settle time and a per-KB cost when the cursor has to move, plus
+  *  a per-byte transfer cost. The cursor ends past the transfer, as a
+  *  tape head would. The device serves one transfer at a time, so the
+  *  transfer also waits for those queued before it, but not for the
+  *  ones of other devices. Called under io_lock.
+  */
+ static int MEMPHY_seq_xfer(struct memphy_struct *mp, int addr, int len)
+ {
+    int dist = MEMPHY_mv_csr(mp, addr);
+    int cost = len * MEMPHY_XFER_COST;
+    uint64_t now = current_time() * MEMPHY_COST_PER_SLOT;
+ 
+    if (dist > 0)
+      cost += MEMPHY_SEEK_BASE + DIV_ROUND_UP(dist, 1024) * MEMPHY_SEEK_COST;
+    mp->cursor = (addr + len) % mp->maxsz;
+ 
+    if (mp->busy_until < now)
+      mp->busy_until = now;
+    mp->busy_until += cost;
+    return mp->busy_until - now;
+ }
+ 
+ /*
+  *  MEMPHY_read_block - read @len bytes from @addr into @buf
+  *  @mp: memphy struct
+  *  @addr: first address
+  *  @buf: destination buffer
+  *  @len: number of bytes
+  *
+  *  Returns the modeled latency (0 on random access devices), or -1 if
+  *  the range is out of the device.
+  */
+ int MEMPHY_read_block(struct memphy_struct *mp, int addr, BYTE *buf, int len)
+ {
+    int cost = 0;
+ 
+    if (mp == NULL || mp->storage == NULL || addr < 0 || len < 0 ||
+        addr > mp->maxsz - len)
+      return -1;
+ 
+    if (mp->rdmflg) {
+      memcpy(buf, mp->storage + addr, len);
+      return 0;
+    }
+
+    pthread_mutex_lock(&mp->io_lock);
+    cost = MEMPHY_seq_xfer(mp, addr, len);
+    memcpy(buf, mp->storage + addr, len);
+    pthread_mutex_unlock(&mp->io_lock);
+ 
+    return cost;
+ }
+ 
+ /*
+  *  MEMPHY_write_block - write @len bytes of @buf at @addr
+  *  @mp: memphy struct
+  *  @addr: first address
+  *  @buf: source buffer
+  *  @len: number of bytes
+  *
+  *  Returns the modeled latency (0 on random access devices), or -1 if
+  *  the range is out of the device.
+  */
+ int MEMPHY_write_block(struct memphy_struct *mp, int addr, const BYTE *buf,
+                        int len)
+ {
+    int cost = 0;
+ 
+    if (mp == NULL || mp->storage == NULL || addr < 0 || len < 0 ||
+        addr > mp->maxsz - len)
+      return -1;
+ 
+    if (mp->rdmflg) {
+      memcpy(mp->storage + addr, buf, len);
+      return 0;
+    }
+
+    pthread_mutex_lock(&mp->io_lock);
+    cost = MEMPHY_seq_xfer(mp, addr, len);
+    memcpy(mp->storage + addr, buf, len);
+    pthread_mutex_unlock(&mp->io_lock);
+ 
+    return cost;
+ }
+ 
+ /*
+  *  MEMPHY_copy_frame - copy a whole frame between devices
+  *  @src: source device
+  *  @srcfpn: source frame
+  *  @dst: destination device
+  *  @dstfpn: destination frame
+  *
+  *  Returns the modeled latency of both transfers, or -1 on a bad frame.
+  */
+ int MEMPHY_copy_frame(struct memphy_struct *src, int srcfpn,
+                       struct memphy_struct *dst, int dstfpn)
+ {
+    BYTE page[PAGING_PAGESZ];
+    int rcost, wcost;
+ 
+    rcost = MEMPHY_read_block(src, srcfpn * PAGING_PAGESZ, page,
+                              PAGING_PAGESZ);
+    if (rcost < 0)
+      return -1;
+    wcost = MEMPHY_write_block(dst, dstfpn * PAGING_PAGESZ, page,
+                               PAGING_PAGESZ);
+    if (wcost < 0)
+      return -1;
+ 
+    return rcost + wcost;
+ }
+ 
  /*
   *  MEMPHY_format-format MEMPHY device
   *  @mp: memphy struct
+  *
+  *  The bitmap starts zeroed (all frames free), which calloc hands out
+  *  as untouched pages, so formatting does not depend on device size.
+  *  Only the bits past the last frame of each level are marked used.
   */
  int MEMPHY_format(struct memphy_struct *mp, int pagesz)
  {
      /* This setting comes with fixed constant PAGESZ */
      int numfp = mp->maxsz / pagesz;
-     struct framephy_struct *newfst, *fst;
-     int iter = 1;
+     int nbits = numfp;
+     int lv = 0;
+     int i;
+ 
+     mp->numfp = 0;
+     mp->nfree = 0;
+     mp->bm_levels = 0;
+     mp->frmtbl = NULL;
+     mp->used_head = mp->used_tail = NULL;
+     pthread_mutex_init(&mp->fp_lock, NULL);
+     pthread_mutex_init(&mp->io_lock, NULL);
+     for (i = 0; i < MEMPHY_NR_PCP; i++) {
+       pthread_mutex_init(&mp->pcp[i].lock, NULL);
+       mp->pcp[i].count = 0;
+     }
  
      if (numfp <= 0)
        return -1;
  
-     /* Init head of free framephy list */ 
-     fst = malloc(sizeof(struct framephy_struct));
-     fst->fpn = 0;
-     mp->free_fp_list = fst;
- 
-     /* We have list with first element, fill in the rest numfp-1 elements */
-     while (iter < numfp) {
-        newfst = malloc(sizeof(struct framephy_struct));
-        newfst->fpn = iter;
-        newfst->fp_next = NULL;
-        fst->fp_next = newfst;
-        fst = newfst;
-        iter++;
-     }
+     do {
+       int nwords = DIV_ROUND_UP(nbits, 64);
+ 
+       mp->bm[lv] = calloc(nwords, sizeof(uint64_t));
+       if (nbits % 64)
+         mp->bm[lv][nwords - 1] = ~0ULL << (nbits % 64);
+ 
+       nbits = nwords;
+       lv++;
+     } while (nbits > 1);
+ 
+     mp->bm_levels = lv;
+     mp->numfp = numfp;
+     mp->nfree = numfp;
+     mp->frmtbl = calloc(numfp, sizeof(struct framephy_struct));
  
      return 0;
  }
  
+ /* Mark frame @fpn used, flagging full words up the hierarchy */
+ static void bm_set(struct memphy_struct *mp, int fpn)
+ {
+    int lv;
+ 
+    for (lv = 0; lv < mp->bm_levels; lv++) {
+      mp->bm[lv][fpn / 64] |= 1ULL << (fpn % 64);
+      if (mp->bm[lv][fpn / 64] != ~0ULL)
+        break;
+      fpn /= 64;
+    }
+ }
+ 
+ /* Mark frame @fpn free, clearing full flags up the hierarchy */
+ static void bm_clear(struct memphy_struct *mp, int fpn)
+ {
+    int lv;
+ 
+    for (lv = 0; lv < mp->bm_levels; lv++) {
+      int was_full = (mp->bm[lv][fpn / 64] == ~0ULL);
+ 
+      mp->bm[lv][fpn / 64] &= ~(1ULL << (fpn % 64));
+      if (!was_full)
+        break;
+      fpn /= 64;
+    }
+ }
+ 
+ static int bm_test(struct memphy_struct *mp, int fpn)
+ {
+    return (mp->bm[0][fpn / 64] >> (fpn % 64)) & 1;
+ }
+ 
+ /* Used chain helpers, called under fp_lock. Moving a frame along the
+  * chain leaves its owner alone, which only changes under the owner's
+  * lock */
+ static void used_link_tail(struct memphy_struct *mp,
+                            struct framephy_struct *fp)
+ {
+    fp->fp_next = NULL;
+    fp->fp_prev = mp->used_tail;
+    if (mp->used_tail != NULL)
+      mp->used_tail->fp_next = fp;
+    else
+      mp->used_head = fp;
+    mp->used_tail = fp;
+ }
+ 
+ static void used_detach(struct memphy_struct *mp, struct framephy_struct *fp)
+ {
+    if (fp->fp_prev != NULL)
+      fp->fp_prev->fp_next = fp->fp_next;
+    else
+      mp->used_head = fp->fp_next;
+    if (fp->fp_next != NULL)
+      fp->fp_next->fp_prev = fp->fp_prev;
+    else
+      mp->used_tail = fp->fp_prev;
+    fp->fp_next = fp->fp_prev = NULL;
+ }
+ 
+ static void used_unlink(struct memphy_struct *mp, struct framephy_struct *fp)
+ {
+    used_detach(mp, fp);
+    fp->owner = NULL;
+ }
+ 
+ /* CPU of the calling thread, -1 outside the CPU threads */
+ static __thread int memphy_cpu = -1;
+ 
+ /*
+  *  MEMPHY_set_cpu - give the calling thread the frame caches of @cpu
+  */
+ void MEMPHY_set_cpu(int cpu)
+ {
+    memphy_cpu = cpu;
+ }
+ 
+ /* Take the lowest free frame, called under fp_lock with nfree > 0.
+  * Walks from the top word down to level 0 with find-first-zero,
+  * O(levels) per call */
+ static int take_freefp(struct memphy_struct *mp)
+ {
+    int lv, idx = 0;
+ 
+    for (lv = mp->bm_levels - 1; lv >= 0; lv--)
+      idx = idx * 64 + __builtin_ctzll(~mp->bm[lv][idx]);
+ 
+    bm_set(mp, idx);
+    mp->nfree--;
+    return idx;
+ }
+ 
+ /*
+  *  MEMPHY_drain_pcp - give the frames of every CPU cache back
+  *  @mp: memphy struct
+  *
+  *  Returns the number of frames given back.
+  */
+ int MEMPHY_drain_pcp(struct memphy_struct *mp)
+ {
+    int i, n = 0;
+ 
+    for (i = 0; i < MEMPHY_NR_PCP; i++) {
+      struct memphy_pcp *pcp = &mp->pcp[i];
+ 
+      pthread_mutex_lock(&pcp->lock);
+      pthread_mutex_lock(&mp->fp_lock);
+      for (; pcp->count > 0; n++) {
+        bm_clear(mp, pcp->fpn[--pcp->count]);
+        mp->nfree++;
+      }
+      pthread_mutex_unlock(&mp->fp_lock);
+      pthread_mutex_unlock(&pcp->lock);
+    }
+ 
+    return n;
+ }
+ 
+ /*
+  *  MEMPHY_nr_free - free frames of the device, counting the CPU caches
+  *
+  *  Read without locks, so only a hint for watermark checks.
+  */
+ int MEMPHY_nr_free(struct memphy_struct *mp)
+ {
+    int i, n = __atomic_load_n(&mp->nfree, __ATOMIC_RELAXED);
+ 
+    for (i = 0; i < MEMPHY_NR_PCP; i++)
+      n += __atomic_load_n(&mp->pcp[i].count, __ATOMIC_RELAXED);
+    return n;
+ }
+ 
+ /*
+  *  MEMPHY_get_freefp - take a free frame
+  *  @mp: memphy struct
+  *  @retfpn: obtained frame
+  *
+  *  A CPU thread takes frames from its own cache, which it refills with
+  *  the MEMPHY_PCP_BATCH lowest free frames of the device, so fp_lock
+  *  is taken once per batch. Once the device is empty, the frames left
+  *  in the caches of other CPUs are given back before failing.
+  *  Other threads take the lowest free frame.
+  */
  int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
  {
-    struct framephy_struct *fp = mp->free_fp_list;
+    if (memphy_cpu >= 0 && mp->numfp > 0) {
+      struct memphy_pcp *pcp = &mp->pcp[memphy_cpu % MEMPHY_NR_PCP];
+      int i;
+ 
+      pthread_mutex_lock(&pcp->lock);
+      if (pcp->count == 0) {
+        pthread_mutex_lock(&mp->fp_lock);
+        pcp->count = mp->nfree < MEMPHY_PCP_BATCH ? mp->nfree
+                                                  : MEMPHY_PCP_BATCH;
+        for (i = pcp->count - 1; i >= 0; i--)
+          pcp->fpn[i] = take_freefp(mp);
+        pthread_mutex_unlock(&mp->fp_lock);
+      }
+      if (pcp->count > 0) {
+        *retfpn = pcp->fpn[--pcp->count];
+        pthread_mutex_unlock(&pcp->lock);
+        return 0;
+      }
+      pthread_mutex_unlock(&pcp->lock);
+ 
+      if (MEMPHY_drain_pcp(mp) == 0)
+        return -1;
+    }
+ 
+    pthread_mutex_lock(&mp->fp_lock);
+    if (mp->nfree == 0) {
+      pthread_mutex_unlock(&mp->fp_lock);
+      return -1;
+    }
+    *retfpn = take_freefp(mp);
+    pthread_mutex_unlock(&mp->fp_lock);
+ 
+    return 0;
+ }
+ 
+ /* Bit j of the result is set when the 2^@order frames of word @w
+  * starting at j are free and j is aligned to 2^@order (@order <= 6) */
+ static uint64_t word_free_blocks(uint64_t w, int order)
+ {
+    static const uint64_t align[7] = {
+      ~0ULL, 0x5555555555555555ULL, 0x1111111111111111ULL,
+      0x0101010101010101ULL, 0x0001000100010001ULL,
+      0x0000000100000001ULL, 0x0000000000000001ULL
+    };
+    uint64_t f = ~w;
+    int s;
+ 
+    for (s = 1; s < (1 << order); s <<= 1)
+      f &= f >> s;
+ 
+    return f & align[order];
+ }
+ 
+ /* Number of free, naturally aligned blocks of 2^@order frames */
+ static int count_free_blocks(struct memphy_struct *mp, int order)
+ {
+    int nwords = DIV_ROUND_UP(mp->numfp, 64);
+    int i, j, n, cnt = 0;
+ 
+    if (order <= 6) {
+      for (i = 0; i < nwords; i++)
+        cnt += __builtin_popcountll(word_free_blocks(mp->bm[0][i], order));
+      return cnt;
+    }
+ 
+    n = 1 << (order - 6);
+    for (i = 0; i + n <= nwords; i += n) {
+      for (j = 0; j < n && mp->bm[0][i + j] == 0; j++)
+        ;
+      cnt += (j == n);
+    }
+    return cnt;
+ }
+ 
+ /*
+  *  MEMPHY_get_freefp_order - take 2^@order physically contiguous frames
+  *  @mp: memphy struct
+  *  @order: block order, up to MEMPHY_MAX_ORDER
+  *  @retfpn: first frame of the block, aligned to 2^@order
+  *
+  *  Buddy allocation on the frame bitmap: a block is a naturally
+  *  aligned run of 2^order frames. Small blocks are split out of
+  *  partially used words first, so that whole free words stay available
+  *  for large blocks. Freed frames clear their bits one by one, which
+  *  coalesces them back into every enclosing block at once. Frames held
+  *  in CPU caches break blocks up, so they are given back before failing.
+  */
+ static int get_freefp_order(struct memphy_struct *mp, int order, int *retfpn)
+ {
+    int nwords, i, j, n;
+    int fpn = -1, empty = -1;
  
-    if (fp == NULL)
+    if (order == 0)
+      return MEMPHY_get_freefp(mp, retfpn);
+    if (order < 0 || order > MEMPHY_MAX_ORDER || (1 << order) > mp->numfp)
       return -1;
  
+    pthread_mutex_lock(&mp->fp_lock);
+    nwords = DIV_ROUND_UP(mp->numfp, 64);
+ 
+    if (order <= 6) {
+      for (i = 0; i < nwords && fpn < 0; i++) {
+        uint64_t w = mp->bm[0][i];
+ 
+        if (w == 0) {
+          if (empty < 0)
+            empty = i;
+        } else if (w != ~0ULL && (w = word_free_blocks(w, order)) != 0) {
+          fpn = i * 64 + __builtin_ctzll(w);
+        }
+      }
+      if (fpn < 0 && empty >= 0)
+        fpn = empty * 64;
+    } else {
+      n = 1 << (order - 6);
+      for (i = 0; i + n <= nwords && fpn < 0; i += n) {
+        for (j = 0; j < n && mp->bm[0][i + j] == 0; j++)
+          ;
+        if (j == n)
+          fpn = i * 64;
+      }
+    }
+ 
+    if (fpn < 0) {
+      pthread_mutex_unlock(&mp->fp_lock);
+      return -1;
+    }
+ 
+    for (i = 0; i < (1 << order); i++)
+      bm_set(mp, fpn + i);
+    mp->nfree -= 1 << order;
+    pthread_mutex_unlock(&mp->fp_lock);
+ 
+    *retfpn = fpn;
+    return 0;
+ }
+ 
+ int MEMPHY_get_freefp_order(struct memphy_struct *mp, int order, int *retfpn)
+ {
+    if (get_freefp_order(mp, order, retfpn) == 0)
+      return 0;
+    if (order == 0 || MEMPHY_drain_pcp(mp) == 0)
+      return -1;
+    return get_freefp_order(mp, order, retfpn);
+ }
+ 
+ /*
+  *  MEMPHY_get_fragstat - buddy view of the free frames
+  *  @mp: memphy struct
+  *  @st: obtained statistics
+  *
+  *  nblocks[k] counts maximal free blocks of order k, i.e. blocks whose
+  *  buddy is not free. Each free block of order k+1 holds two free
+  *  blocks of order k, which gives the count without a walk per block.
+  */
+ int MEMPHY_get_fragstat(struct memphy_struct *mp, struct memphy_fragstat *st)
+ {
+    int k, cnt, parent;
+ 
+    pthread_mutex_lock(&mp->fp_lock);
+    st->numfp = mp->numfp;
+    st->nfree = mp->nfree;
+    st->max_order = -1;
+ 
+    parent = 0;
+    for (k = MEMPHY_MAX_ORDER; k >= 0; k--) {
+      cnt = ((1 << k) <= mp->numfp) ? count_free_blocks(mp, k) : 0;
+      st->nblocks[k] = cnt - 2 * parent;
+      if (st->max_order < 0 && cnt > 0)
+        st->max_order = k;
+      parent = cnt;
+    }
+    pthread_mutex_unlock(&mp->fp_lock);
+ 
+    return 0;
+ }
+ 
+ int MEMPHY_dump_fragstat(struct memphy_struct *mp, const char *name)
+ {
+    struct memphy_fragstat st;
+    int k;
+ 
+    if (mp->numfp == 0)
+      return -1;
+ 
+    MEMPHY_get_fragstat(mp, &st);
+    printf("%s: %d/%d frames free, largest free block 2^%d frames\n",
+           name, st.nfree, st.numfp, st.max_order);
+    printf("%s: free blocks per order:", name);
+    for (k = 0; k <= MEMPHY_MAX_ORDER; k++)
+      printf(" %d", st.nblocks[k]);
+    printf("\n");
+ 
+    return 0;
+ }
+ 
+ /*
+  *  MEMPHY_set_owner - record the page mapped to a frame
+  *  @mp: memphy struct
+  *  @fpn: frame number
+  *  @owner: mm of the page, NULL once the frame is unmapped
+  *  @pgn: page number in @owner
+  *
+  *  A newly owned frame goes to the tail of the used chain, no longer
+  *  busy.
+  */
+ int MEMPHY_set_owner(struct memphy_struct *mp, int fpn,
+                      struct mm_struct *owner, int pgn)
+ {
+    struct framephy_struct *fp;
+ 
+    if (fpn < 0 || fpn >= mp->numfp)
+      return -1;
+ 
+    fp = &mp->frmtbl[fpn];
+    pthread_mutex_lock(&mp->fp_lock);
+    if (fp->owner != NULL)
+      used_unlink(mp, fp);
+    fp->fpn = fpn;
+    fp->pgn = pgn;
+    fp->age = 0;
+    if (owner != NULL) {
+      fp->owner = owner;
+      used_link_tail(mp, fp);
+      fp->busy = 0;
+    }
+    pthread_mutex_unlock(&mp->fp_lock);
+ 
+    return 0;
+ }
+ 
+ /* Lock the owner of @fp for an eviction, 0 if not possible right now.
+  * The lock of the faulting process is recursive, so its own frames
+  * always qualify */
+ static int victim_trylock(struct framephy_struct *fp)
+ {
+    return !fp->busy && pthread_mutex_trylock(&fp->owner->lock) == 0;
+ }
+ 
+ /*
+  *  MEMPHY_pick_victim - take a frame to evict
+  *  @mp: memphy struct
+  *  @self: mm of the faulting process
+  *  @floor: resident pages no other process is pushed below
+  *  @policy: MM_POLICY_* replacement policy
+  *  @retfpn, @retowner, @retpgn: the victim frame and the page it held
+  *
+  *  Candidates are the frames of @self and of processes above @floor,
+  *  oldest mapping first. FIFO takes the first one. SECOND and CLOCK
+  *  give accessed frames a second chance by requeueing them at the tail
+  *  with the accessed bit cleared; on the used chain, the CLOCK hand is
+  *  the chain head, so both behave alike. AGING only reads the ages
+  *  MEMPHY_age_frames() keeps, with the accessed bit of the pending
+  *  period shifted in, and takes the first frame unused over the whole
+  *  history, or else the least recently used one.
+  *
+  *  The frame leaves the used chain with no owner and busy, so that
+  *  concurrent faults never pick it twice; the caller owns it from now
+  *  on. When every process is at its floor, the oldest frame is taken
+  *  anyway, except for background reclaim (@self NULL).
+  *
+  *  Frames are taken with the lock of their owner, which the caller
+  *  releases once the page is out. Owners in the middle of a memory
+  *  operation on another CPU are skipped: fp_lock nests inside mm
+  *  locks, so they are only tried here.
+  */
+ int MEMPHY_pick_victim(struct memphy_struct *mp, struct mm_struct *self,
+                        int floor, int policy, int *retfpn,
+                        struct mm_struct **retowner, int *retpgn)
+ {
+    struct framephy_struct *fp, *next, *best = NULL;
+    uint32_t *pte, accessed;
+    int budget, age, bestage = 0;
+ 
+    pthread_mutex_lock(&mp->fp_lock);
+    if (policy == MM_POLICY_AGING) {
+      for (fp = mp->used_head; fp != NULL; fp = fp->fp_next) {
+        if (fp->busy || (fp->owner != self &&
+            __atomic_load_n(&fp->owner->rss, __ATOMIC_RELAXED) <= floor))
+          continue;
+        pte = pte_lookup(fp->owner, fp->pgn);
+        accessed = __atomic_load_n(pte, __ATOMIC_RELAXED) &
+                   PAGING_PTE_ACCESSED_MASK;
+        age = (fp->age >> 1) | (accessed ? 0x80 : 0);
+        if (age == 0 && victim_trylock(fp))
+          break;
+        if (best == NULL || age < bestage) {
+          best = fp;
+          bestage = age;
+        }
+      }
+      if (fp == NULL && best != NULL && victim_trylock(best))
+        fp = best;
+    } else {
+      /* Each frame is requeued at most once per pick */
+      budget = mp->numfp - mp->nfree;
+      for (fp = mp->used_head; fp != NULL; fp = next) {
+        next = fp->fp_next;
+        if (fp->busy || (fp->owner != self &&
+            __atomic_load_n(&fp->owner->rss, __ATOMIC_RELAXED) <= floor))
+          continue;
+        pte = pte_lookup(fp->owner, fp->pgn);
+        accessed = __atomic_load_n(pte, __ATOMIC_RELAXED) &
+                   PAGING_PTE_ACCESSED_MASK;
+        if (policy == MM_POLICY_FIFO || !accessed ||
+            budget-- <= 0) {
+          if (victim_trylock(fp))
+            break;
+          continue;
+        }
+        CLRBIT_ATOMIC(*pte, PAGING_PTE_ACCESSED_MASK);
+        used_detach(mp, fp);
+        used_link_tail(mp, fp);
+        if (next == NULL)
+          next = fp;
+      }
+    }
+    if (fp == NULL && self != NULL) {
+      for (fp = mp->used_head; fp != NULL && !victim_trylock(fp);
+           fp = fp->fp_next)
+        ;
+    }
+    if (fp == NULL) {
+      pthread_mutex_unlock(&mp->fp_lock);
+      return -1;
+    }
+ 
     *retfpn = fp->fpn;
-    mp->free_fp_list = fp->fp_next;
+    *retowner = fp->owner;
+    *retpgn = fp->pgn;
+    used_unlink(mp, fp);
+    fp->busy = 1;
+    pthread_mutex_unlock(&mp->fp_lock);
+ 
+    return 0;
+ }
+ 
+ /*
+  *  MEMPHY_age_frames - age the used frames for AGING replacement
+  *  @mp: memphy struct
+  *
+  *  Shifts the age of every used frame right and moves the accessed bit
+  *  of its page into the top bit, clearing it. Called once per time slot
+  *  by kswapd under global replacement, so faults only read the ages.
+  *  The page table is only touched under the lock of its owner; busy
+  *  frames and owners in the middle of a memory operation keep their
+  *  age until the next period. Returns the number of frames aged.
+  */
+ int MEMPHY_age_frames(struct memphy_struct *mp)
+ {
+    struct framephy_struct *fp;
+    struct mm_struct *locked = NULL;
+    uint32_t *pte, accessed;
+    int n = 0;
+
+    pthread_mutex_lock(&mp->fp_lock);
+    for (fp = mp->used_head; fp != NULL; fp = fp->fp_next) {
+      if (fp->busy)
+        continue;
+      /* The chain keeps frames of one owner together often enough */
+      if (fp->owner != locked) {
+        if (locked != NULL)
+          pthread_mutex_unlock(&locked->lock);
+        locked = pthread_mutex_trylock(&fp->owner->lock) == 0 ?
+                 fp->owner : NULL;
+        if (locked == NULL)
+          continue;
+      }
+      pte = pte_lookup(fp->owner, fp->pgn);
+      accessed = CLRBIT_ATOMIC(*pte, PAGING_PTE_ACCESSED_MASK) &
+                 PAGING_PTE_ACCESSED_MASK;
+      fp->age = (fp->age >> 1) | (accessed ? 0x80 : 0);
+      n++;
+    }
+    if (locked != NULL)
+      pthread_mutex_unlock(&locked->lock);
+    pthread_mutex_unlock(&mp->fp_lock);
+
+    return n;
+ }
+
+/*
+  *  MEMPHY_get_frame - frame table entry of @fpn, NULL if out of range
+  */
+ struct framephy_struct *MEMPHY_get_frame(struct memphy_struct *mp, int fpn)
+ {
+    if (fpn < 0 || fpn >= mp->numfp)
+      return NULL;
  
-    free(fp);
+    return &mp->frmtbl[fpn];
+ }
+ 
+ /*
+  *  MEMPHY_dump_frames - list the used frames and the pages they hold
+  */
+ int MEMPHY_dump_frames(struct memphy_struct *mp, const char *name)
+ {
+    int fpn;
+ 
+    printf("%s: frame table\n", name);
+    for (fpn = 0; fpn < mp->numfp; fpn++) {
+      struct framephy_struct *fp = &mp->frmtbl[fpn];
+ 
+      if (fp->owner != NULL)
+        printf("%s: fpn=%d -> pid=%d pgn=%d\n", name, fpn,
+               fp->owner->pid, fp->pgn);
+    }
  
     return 0;
  }
  
+ /*
+  *  MEMPHY_check - check the frame table against the bitmap
+  *  @mp: memphy struct
+  *  @name: device name for the report
+  *
+  *  Owned frames must be used and not busy, the used chain must link
+  *  exactly the owned frames and the free count must match the bitmap.
+  *  Returns the number of broken invariants, printed as they are found.
+  */
+ int MEMPHY_check(struct memphy_struct *mp, const char *name)
+ {
+    struct framephy_struct *fp, *prev = NULL;
+    int fpn, nzero = 0, nowned = 0, nchain = 0, bad = 0;
+ 
+    pthread_mutex_lock(&mp->fp_lock);
+    for (fpn = 0; fpn < mp->numfp; fpn++) {
+      fp = &mp->frmtbl[fpn];
+      nzero += !bm_test(mp, fpn);
+      if (fp->owner == NULL)
+        continue;
+      nowned++;
+      if (!bm_test(mp, fpn) || fp->busy) {
+        printf("%s: check: owned fpn=%d is %s\n", name, fpn,
+               fp->busy ? "busy" : "free");
+        bad++;
+      }
+    }
+ 
+    for (fp = mp->used_head; fp != NULL && nchain <= nowned;
+         fp = fp->fp_next, nchain++) {
+      if (fp->fp_prev != prev || fp->owner == NULL) {
+        printf("%s: check: used chain broken at fpn=%d\n", name, fp->fpn);
+        bad++;
+      }
+      prev = fp;
+    }
+    if (nchain != nowned || prev != mp->used_tail) {
+      printf("%s: check: %d frames on the used chain, %d owned\n",
+             name, nchain, nowned);
+      bad++;
+    }
+    if (nzero != mp->nfree) {
+      printf("%s: check: %d free frames counted, %d in the bitmap\n",
+             name, mp->nfree, nzero);
+      bad++;
+    }
+    pthread_mutex_unlock(&mp->fp_lock);
+ 
+    return bad;
+ }
+ 
  int MEMPHY_dump(struct memphy_struct * mp)
  {
      /*TODO dump memphy content mp->storage */
      return 0;
  }
  
+ #ifdef MEMPHY_RELEASE_FREED
+ /*
+  *  release_host_page - give back the host page holding frame @fpn
+  *  once every frame in it is free. Called under fp_lock, so no frame
+  *  of that host page can be handed out meanwhile.
+  */
+ static void release_host_page(struct memphy_struct *mp, int fpn)
+ {
+    int per_page = mp->host_pgsz / PAGING_PAGESZ;
+    int first = fpn - fpn % per_page;
+    uint64_t mask;
+ 
+    /* Host pages hold a power of two frames, at most 64 on usual hosts */
+    if (per_page <= 1 || per_page > 64 || first + per_page > mp->numfp)
+      return;
+ 
+    mask = (per_page == 64) ? ~0ULL :
+           ((1ULL << per_page) - 1) << (first % 64);
+    if (mp->bm[0][first / 64] & mask)
+      return;
+ 
+    /* A shared file mapping keeps its data under MADV_DONTNEED, so the
+     * file blocks are punched out instead */
+    madvise(mp->storage + (size_t)first * PAGING_PAGESZ, mp->host_pgsz,
+            mp->fd < 0 ? MADV_DONTNEED : MADV_REMOVE);
+ }
+ #endif
+ 
  int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
  {
-    struct framephy_struct *fp = mp->free_fp_list;
-    struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+    if (fpn < 0 || fpn >= mp->numfp)
+      return -1;
  
-    newnode->fpn = fpn;
-    newnode->fp_next = fp;
-    mp->free_fp_list = newnode;
+    pthread_mutex_lock(&mp->fp_lock);
+    if (!bm_test(mp, fpn)) {
+      /* Double free, keep the count right */
+      pthread_mutex_unlock(&mp->fp_lock);
+      return -1;
+    }
+    bm_clear(mp, fpn);
+    mp->nfree++;
+    if (mp->frmtbl[fpn].owner != NULL)
+      used_unlink(mp, &mp->frmtbl[fpn]);
+    mp->frmtbl[fpn].swpslot = 0;
+    mp->frmtbl[fpn].swptyp = 0;
+    mp->frmtbl[fpn].busy = 0;
+    mp->frmtbl[fpn].ra = 0;
+ #ifdef MEMPHY_RELEASE_FREED
+    release_host_page(mp, fpn);
+ #endif
+    pthread_mutex_unlock(&mp->fp_lock);
  
     return 0;
  }
  
  /*
-  *  Init MEMPHY struct
+  *  init_memphy_backed - init MEMPHY struct
+  *  @mp: memphy struct
+  *  @max_size: device size in bytes
+  *  @randomflg: random access device
+  *  @path: backing file, NULL for host memory
+  *
+  *  The storage is a lazy mapping rather than a malloc of max_size: the
+  *  host commits a page on its first write, so a large swap device only
+  *  costs what is actually swapped out. A backing file is created
+  *  sparse, with the same effect on disk.
   */
- int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
+ int init_memphy_backed(struct memphy_struct *mp, int max_size,
+                        int randomflg, const char *path)
  {
-    mp->storage = (BYTE *)malloc(max_size * sizeof(BYTE));
+    void *storage = NULL;
+ 
+    mp->fd = -1;
+    mp->path = NULL;
+    mp->host_pgsz = sysconf(_SC_PAGESIZE);
+ 
+    if (max_size > 0 && path != NULL) {
+      /* Never clobber a file that is there already */
+      mp->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+      if (mp->fd < 0) {
+        printf("Cannot create MEMPHY backing file %s: %s\n", path,
+               errno == EEXIST ? "it exists already" : "open failed");
+        return -1;
+      }
+      if (ftruncate(mp->fd, max_size) < 0) {
+        printf("Cannot create MEMPHY backing file %s\n", path);
+        close(mp->fd);
+        unlink(path);
+        return -1;
+      }
+      mp->path = strdup(path);
+      storage = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     mp->fd, 0);
+    } else if (max_size > 0) {
+      storage = mmap(NULL, max_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (storage == MAP_FAILED) {
+      printf("Cannot map MEMPHY storage of %d bytes\n", max_size);
+      if (mp->fd >= 0) {
+        close(mp->fd);
+        unlink(mp->path);
+        free(mp->path);
+      }
+      return -1;
+    }
+ 
+    mp->storage = (BYTE *)storage;
     mp->maxsz = max_size;
  
     MEMPHY_format(mp, PAGING_PAGESZ);
  
     mp->rdmflg = (randomflg != 0) ? 1 : 0;
  
-    if (!mp->rdmflg)
+    if (!mp->rdmflg) {
        mp->cursor = 0;
+       mp->busy_until = 0;
+    }
+ 
+    return 0;
+ }
+ 
+ /*
+  *  Init MEMPHY struct
+  */
+ int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
+ {
+    return init_memphy_backed(mp, max_size, randomflg, NULL);
+ }
+ 
+ /*
+  *  free_memphy - unmap the storage and drop the bitmap of a device
+  */
+ int free_memphy(struct memphy_struct *mp)
+ {
+    int lv;
+ 
+    if (mp->storage != NULL)
+      munmap(mp->storage, mp->maxsz);
+    if (mp->fd >= 0)
+      close(mp->fd);
+    if (mp->path != NULL)
+      unlink(mp->path);
+    free(mp->path);
+    for (lv = 0; lv < mp->bm_levels; lv++)
+      free(mp->bm[lv]);
+    free(mp->frmtbl);
  
+    mp->storage = NULL;
+    mp->frmtbl = NULL;
+    mp->fd = -1;
+    mp->path = NULL;
+    mp->bm_levels = 0;
+    mp->numfp = mp->nfree = 0;
     return 0;
  }
  
@@ -10,42 +10,56 @@
  #include <pthread.h>
  
 
-#define TRACE_VMA 1                 /* set to 0 to silence            */
-
-/* ------------------------------------------------------------------
- *  Return pointer to the <idx>-th vm_area or NULL.
- * ------------------------------------------------------------------ */
+/*
+ * get_vma_by_num - VM area of a given id, NULL if there is none.
+ */
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int idx)
 {
-#if TRACE_VMA
-    printf("[DBG][vma] lookup mm=%p idx=%d\n",(void*)mm,idx);
-#endif
-    if (!mm) { puts("[ERR][vma] *** mm == NULL ***"); return NULL; }
-
-    struct vm_area_struct *v = mm->mmap;
-    int hop = 0;
-    while (v && hop < idx) { v = v->vm_next; ++hop; }
-
-#if TRACE_VMA
-    printf("[DBG][vma] → %p after %d hops\n",(void*)v,hop);
-#endif
-    return v;                                    /* may be NULL       */
+    if (!mm || idx < 0 || idx >= MM_NR_VMA) return NULL;
+    return mm->vmas[idx];
 }
 
-
+/*
+ * get_vma_by_addr - VM area whose window holds an address, NULL if none.
+ * Binary search, the areas being in address order.
+ */
+struct vm_area_struct *get_vma_by_addr(struct mm_struct *mm, unsigned long addr)
+{
+    int lo = 0, hi = MM_NR_VMA - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        struct vm_area_struct *v = mm->vmas[mid];
+
+        if (addr < v->vm_start)
+            hi = mid - 1;
+        else if (addr >= v->vm_limit)
+            lo = mid + 1;
+        else
+            return v;
+    }
+    return NULL;
+}
  
  
  /*
   * __mm_swap_page - Swap copy a page from a victim frame to a swap frame.
   * @caller: The caller's process control block.
   * @vicfpn: Victim frame page number (in MEMRAM).
-  * @swpfpn: Swap frame page number (in the active swap device).
+  * @swpfpn: Swap frame page number (in swap device @swptyp).
+  * @swptyp: Swap device.
+  *
+  * The latency of the copy is charged to the caller.
   *
   * Returns 0 on success.
   */
- int __mm_swap_page(struct pcb_t *caller, int vicfpn, int swpfpn)
+ int __mm_swap_page(struct pcb_t *caller, int vicfpn, int swpfpn, int swptyp)
  {
-     __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
+     int cost = __swap_cp_page(caller->mram, vicfpn,
+                               &caller->mswp[swptyp], swpfpn);
+     if (cost < 0)
+         return -1;
+     caller->io_stall += cost;
      return 0;
  }
  
@@ -79,33 +93,30 @@ struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int idx)
   * @vmastart: Start address of the planned region.
   * @vmaend:   End address of the planned region.
   *
+  * The region must stay inside the window of its area and clear of the
+  * used part of every other area.
+  *
   * Returns 0 if the region is valid (no overlap), or -1 if an overlap is detected.
   */
-/* mm-vm.c  ------------------------------------------------------------- */
-/* --------------------------------------------------------------------
- * Return 0  →  “OK, go ahead and extend the heap”
- * Return -1 →  “Overlap with an *allocated* region, refuse the request”
- *
- * Rules:
- *   • A node whose size is 0 ([x..x)) is just a sentinel → skip it.
- *   • If the free-list is completely empty (or only zero-size nodes),
- *     there can be no overlap      → succeed.
- *   • Overlap detection is done against ALLOCATED space, **not** against
- *     the holes themselves, so we simply walk the free list and look
- *     for a real conflict; if none is found we return success.
- * ------------------------------------------------------------------ */
-/* mm-vm.c ------------------------------------------------------------- */
 int validate_overlap_vm_area(struct pcb_t *caller,
                              int vmaid,
                              int vmastart,
                              int vmaend)
 {
     struct vm_area_struct *vma = get_vma_by_num(caller->mm, vmaid);
-    if (!vma)                 /* shouldn’t happen */
+    int i;
+
+    if (!vma || !INCLUDE(vma->vm_start, vma->vm_limit,
+                         (unsigned long)vmastart, (unsigned long)vmaend))
         return -1;
 
-    /* if we are adding space *after* the current end, there is no overlap */
-    return (vmastart >= (int)vma->vm_end) ? 0 : -1;
+    for (i = 0; i < MM_NR_VMA; i++) {
+        struct vm_area_struct *v = caller->mm->vmas[i];
+        if (v != vma && OVERLAP(v->vm_start, v->vm_end,
+                                (unsigned long)vmastart, (unsigned long)vmaend))
+            return -1;
+    }
+    return 0;
 }
 
 
@@ -116,11 +127,12 @@ int validate_overlap_vm_area(struct pcb_t *caller,
   * @caller: Caller process control block.
   * @vmaid:  VM area ID to be extended.
   * @inc_sz: Requested increment size in bytes.
+  * @flags:  PAGING_ALLOC_* flags of the allocation.
   *
   * Returns 0 on success, or -1 on failure.
   */
 /* mm-vm.c ------------------------------------------------------------ */
-int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
+int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz, int flags)
 {
     /* round the request up to a whole-page multiple */
     int inc_amt   = PAGING_PAGE_ALIGNSZ(inc_sz);
@@ -133,21 +145,28 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
     if (!cur_vma) return -1;
 
     int mapstart = cur_vma->vm_end;          /* grow at the top */
+    if (validate_overlap_vm_area(caller, vmaid, mapstart,
+                                 mapstart + inc_amt) < 0)
+        return -1;                           /* out of its window */
 
-    /* ask MM to obtain physical frames and create PTEs               */
+    /* By default frames come on first touch; populating (which a
+     * contiguous allocation implies) maps them all right away        */
     struct vm_rg_struct dummy;
-    if (vm_map_ram(caller, mapstart, mapstart + inc_amt,
-                   mapstart, inc_pages, &dummy) < 0)
+    if (!(flags & (PAGING_ALLOC_POPULATE | PAGING_ALLOC_CONTIG)))
+    {
+        if (vm_reserve_range(caller, mapstart, inc_pages) < 0)
+            return -1;
+    }
+    else if (vm_map_ram(caller, mapstart, mapstart + inc_amt,
+                        mapstart, inc_pages, &dummy, flags) < 0)
     {
         printf("[DBG]   vm_map_ram failed\n");
         return -1;
     }
 
-    /* publish the newly-available hole to the free-region list       */
-    struct vm_rg_struct *hole = malloc(sizeof(struct vm_rg_struct));
-    hole->rg_start = mapstart;
-    hole->rg_end   = mapstart + inc_amt;
-    enlist_vm_rg_node(&cur_vma->vm_freerg_list, hole);
+    /* publish the newly-available hole to the free-region list, where
+     * it merges with a free tail of the old heap                     */
+    enlist_vm_freerg_list(cur_vma, init_vm_rg(mapstart, mapstart + inc_amt));
 
     /* advance heap cursors                                           */
     cur_vma->vm_end += inc_amt;
@@ -157,5 +176,36 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
     return 0;                                    /* success */
 }
 
+/*
+ * dec_vma_limit - Shrink the VM area, giving back the whole pages of its
+ * free tail region.
+ * @caller: Caller process control block.
+ * @vmaid:  VM area ID to be shrunk.
+ * @tail:   Free region ending at the top of the area.
+ *
+ * Returns the number of pages given back.
+ */
+int dec_vma_limit(struct pcb_t *caller, int vmaid, struct vm_rg_struct *tail)
+{
+    struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+    if (!cur_vma || !tail || tail->rg_end != cur_vma->vm_end) return 0;
+
+    /* keep the partial page the tail region starts in                */
+    unsigned long newend = PAGING_PAGE_ALIGNSZ(tail->rg_start);
+    int dec_pages = (cur_vma->vm_end - newend) / PAGING_PAGESZ;
+    if (dec_pages < MM_HEAP_TRIM_PAGES || dec_pages <= 0) return 0;
+
+#ifdef MMDBG
+    printf("[DBG] dec_vma_limit pid=%d -%d pages\n", caller->pid, dec_pages);
+#endif
+    vm_unmap_range(caller, newend, dec_pages);
+    resize_vm_freerg(cur_vma, tail, tail->rg_start, newend);
+
+    cur_vma->vm_end = newend;
+    cur_vma->sbrk   = cur_vma->vm_end;
+
+    return dec_pages;
+}
+
  
  
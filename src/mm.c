@@ -7,6 +7,8 @@
  #include "mm.h"
  #include <stdlib.h>
  #include <stdio.h>
+ #include <string.h>
+ #include <pthread.h>
  
  /* 
   * init_pte - Initialize PTE entry
@@ -51,7 +53,8 @@
   */
  int pte_set_swap(uint32_t *pte, int swptyp, int swpoff)
  {
-   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
+   /* A swapped page is not present, its next access faults it back */
+   CLRBIT(*pte, PAGING_PTE_PRESENT_MASK);
    SETBIT(*pte, PAGING_PTE_SWAPPED_MASK);
  
    SETVAL(*pte, swptyp, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
@@ -75,6 +78,104 @@
    return 0;
  }
  
+ /*
+  * pt_leaf - leaf of the page table covering @pgn
+  * @alloc: allocate the missing nodes on the way
+  * @span: when the leaf is missing, the number of pages covered by the
+  *        highest missing node, which a walk can skip at once
+  */
+ static uint32_t *pt_leaf(struct mm_struct *mm, int pgn, int alloc,
+                          long *span)
+ {
+   void **slot = &mm->pgd;
+   int lv;
+ 
+   for (lv = PAGING_PT_LEVELS - 1; ; lv--) {
+     if (*slot == NULL) {
+       size_t sz = PAGING_PT_SIZE * (lv ? sizeof(void *) : sizeof(uint32_t));
+ 
+       if (!alloc) {
+         if (span)
+           *span = 1L << (PAGING_PT_BITS * (lv + 1));
+         return NULL;
+       }
+       if ((*slot = calloc(1, sz)) == NULL)
+         return NULL;
+       __sync_fetch_and_add(&mm->pt_bytes, sz);
+     }
+     if (lv == 0)
+       return (uint32_t *)*slot;
+     slot = &((void **)*slot)[(pgn >> (PAGING_PT_BITS * lv)) &
+                              (PAGING_PT_SIZE - 1)];
+   }
+ }
+ 
+ /*
+  * pte_lookup - PTE of @pgn, NULL if no page around it was ever mapped
+  */
+ uint32_t *pte_lookup(struct mm_struct *mm, int pgn)
+ {
+   uint32_t *leaf;
+ 
+   if (pgn < 0 || pgn >= PAGING_MAX_PGN)
+     return NULL;
+   leaf = pt_leaf(mm, pgn, 0, NULL);
+   return leaf ? &leaf[pgn & (PAGING_PT_SIZE - 1)] : NULL;
+ }
+ 
+ /*
+  * pte_get - PTE of @pgn, allocating the page table nodes to hold it
+  */
+ uint32_t *pte_get(struct mm_struct *mm, int pgn)
+ {
+   uint32_t *leaf;
+ 
+   if (pgn < 0 || pgn >= PAGING_MAX_PGN)
+     return NULL;
+   leaf = pt_leaf(mm, pgn, 1, NULL);
+   return leaf ? &leaf[pgn & (PAGING_PT_SIZE - 1)] : NULL;
+ }
+ 
+ /*
+  * pte_next - first PTE at or after *@pgn held by the page table
+  * Moves *@pgn to the page of the returned PTE. Missing subtrees are
+  * skipped whole, so a walk costs the size of the table, not of the
+  * address space.
+  */
+ uint32_t *pte_next(struct mm_struct *mm, int *pgn)
+ {
+   uint32_t *leaf;
+   long span;
+ 
+   while (*pgn < PAGING_MAX_PGN) {
+     leaf = pt_leaf(mm, *pgn, 0, &span);
+     if (leaf != NULL)
+       return &leaf[*pgn & (PAGING_PT_SIZE - 1)];
+     *pgn = (*pgn & ~(span - 1)) + span;
+   }
+   return NULL;
+ }
+ 
+ static void pt_free_node(void *node, int lv)
+ {
+   int i;
+ 
+   if (node == NULL)
+     return;
+   if (lv > 0)
+     for (i = 0; i < PAGING_PT_SIZE; i++)
+       pt_free_node(((void **)node)[i], lv - 1);
+   free(node);
+ }
+ 
+ int pt_free(struct mm_struct *mm)
+ {
+   pt_free_node(mm->pgd, PAGING_PT_LEVELS - 1);
+   mm->pgd = NULL;
+   mm->pt_bytes = 0;
+   return 0;
+ }
+ 
  /* 
   * vmap_page_range - map a range of page at aligned address
   */
@@ -92,10 +193,17 @@ int vmap_page_range(struct pcb_t *caller,
 
     /* walk while there are still frames AND we haven’t mapped pgnum pages */
     while (frames && pgit < pgnum) {
+        uint32_t *pte = pte_get(caller->mm, pgn+pgit);
+        if (pte == NULL) return -1;
+
         printf("[DBG]   map pgn=%d → fpn=%d\n", pgn+pgit, frames->fpn);
-        caller->mm->pgd[pgn+pgit] = 0;
-        pte_set_fpn(&caller->mm->pgd[pgn+pgit], frames->fpn);
-        enlist_pgn_node(&caller->mm->fifo_pgn, pgn+pgit);
+        *pte = 0;
+        pte_set_fpn(pte, frames->fpn);
+        /* Frames come with stale content, which swap must keep */
+        SETBIT(*pte, PAGING_PTE_DIRTY_MASK);
+        MEMPHY_set_owner(caller->mram, frames->fpn, caller->mm, pgn+pgit);
+        pgring_push(&caller->mm->pgring, pgn+pgit);
+        __sync_fetch_and_add(&caller->mm->rss, 1);
 
         frames = frames->fp_next;
         ++pgit;
@@ -105,6 +213,56 @@ int vmap_page_range(struct pcb_t *caller,
     return 0;
 }
 
+ /* 
+  * vm_reserve_range - reserve pgnum pages at aligned address, leaving
+  * them not present until their first access
+  */
+int vm_reserve_range(struct pcb_t *caller, int addr, int pgnum)
+{
+    int pgn = PAGING_PGN(addr);
+    int pgit;
+
+    for (pgit = 0; pgit < pgnum; pgit++) {
+        uint32_t *pte = pte_get(caller->mm, pgn+pgit);
+        if (pte == NULL) return -1;
+        *pte = PAGING_PTE_RESERVE_MASK;
+    }
+
+    return 0;
+}
+
+ /*
+  * vm_unmap_range - drop pgnum pages at aligned address, giving their
+  * frames and swap slots back
+  */
+int vm_unmap_range(struct pcb_t *caller, int addr, int pgnum)
+{
+    struct mm_struct *mm = caller->mm;
+    int pgn = PAGING_PGN(addr);
+    int pgit;
+
+    for (pgit = 0; pgit < pgnum; pgit++) {
+        uint32_t *pte = pte_lookup(mm, pgn+pgit);
+        if (pte == NULL) continue;
+
+        if (PAGING_PAGE_PRESENT(*pte)) {
+            int fpn = PAGING_PTE_FPN(*pte);
+            struct framephy_struct *fp = MEMPHY_get_frame(caller->mram, fpn);
+
+            if (fp != NULL && fp->swpslot > 0)
+                MEMPHY_put_freefp(&caller->mswp[fp->swptyp], fp->swpslot - 1);
+            MEMPHY_put_freefp(caller->mram, fpn);
+            pgring_remove(&mm->pgring, pgn+pgit);
+            __sync_fetch_and_sub(&mm->rss, 1);
+        } else if (*pte & PAGING_PTE_SWAPPED_MASK) {
+            MEMPHY_put_freefp(&caller->mswp[PAGING_PTE_SWPTYP(*pte)],
+                              PAGING_PTE_SWP(*pte));
+        }
+        *pte = 0;
+    }
+
+    return 0;
+}
 
  
  /* 
@@ -121,7 +279,9 @@ int alloc_pages_range(struct pcb_t *caller, int req_pgnum,
   struct framephy_struct *head = NULL, *tail = NULL;
 
   while (pgit < req_pgnum) {
-    if (MEMPHY_get_freefp(caller->mram, &fpn) == 0) {
+    /* With RAM full, a page of some process makes room */
+    if (MEMPHY_get_freefp(caller->mram, &fpn) == 0 ||
+        mm_evict_frame(caller, &fpn) == 0) {
       printf("[DBG]   grant fpn=%d\n", fpn);
       struct framephy_struct *node = malloc(sizeof(*node));
       node->fpn = fpn; node->fp_next = NULL;
@@ -141,17 +301,60 @@ int alloc_pages_range(struct pcb_t *caller, int req_pgnum,
   return 0;
 }
 
+ /* 
+  * alloc_pages_contig - allocate req_pgnum physically contiguous frames
+  * The smallest buddy block holding req_pgnum frames is taken and the
+  * frames past req_pgnum are given back right away.
+  */
+int alloc_pages_contig(struct pcb_t *caller, int req_pgnum,
+                       struct framephy_struct **frm_lst)
+{
+  int order = 0, fpn, i;
+  struct framephy_struct *head = NULL, *node;
+
+  if (req_pgnum <= 0) return 0;
+  while ((1 << order) < req_pgnum) order++;
+  if (order > MEMPHY_MAX_ORDER ||
+      MEMPHY_get_freefp_order(caller->mram, order, &fpn) < 0)
+    return -3000;
+
+#ifdef MMDBG
+  printf("[DBG] alloc_pages_contig pid=%d grant fpn=%d..%d (order %d)\n",
+         caller->pid, fpn, fpn + req_pgnum - 1, order);
+#endif
+  for (i = (1 << order) - 1; i >= req_pgnum; i--)
+    MEMPHY_put_freefp(caller->mram, fpn + i);
+
+  /* Built backwards so that the list runs in ascending frame order */
+  for (i = req_pgnum - 1; i >= 0; i--) {
+    node = malloc(sizeof(*node));
+    node->fpn = fpn + i;
+    node->fp_next = head;
+    head = node;
+  }
+  *frm_lst = head;
+  return 0;
+}
+
  /* 
   * vm_map_ram - map all VM areas to RAM storage
   */
 int vm_map_ram(struct pcb_t *caller, int astart, int aend,
-               int mapstart, int incpgnum, struct vm_rg_struct *ret_rg)
+               int mapstart, int incpgnum, struct vm_rg_struct *ret_rg,
+               int flags)
 {
   printf("[DBG] vm_map_ram pid=%d pages=%d start=%d\n",
          caller->pid, incpgnum, mapstart);
 
-  struct framephy_struct *frm_lst = NULL;
-  int ret_alloc = alloc_pages_range(caller, incpgnum, &frm_lst);
+  struct framephy_struct *frm_lst = NULL, *fp;
+  int ret_alloc = -3000;
+
+  /* Contiguity is best effort: a fragmented RAM still serves the
+   * request with scattered frames */
+  if ((flags & PAGING_ALLOC_CONTIG) && incpgnum > 1)
+    ret_alloc = alloc_pages_contig(caller, incpgnum, &frm_lst);
+  if (ret_alloc < 0)
+    ret_alloc = alloc_pages_range(caller, incpgnum, &frm_lst);
 
   if (ret_alloc == -3000) {
     printf("[DBG]   OOM – no free frames\n");
@@ -160,48 +363,78 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend,
   if (ret_alloc < 0) return -1;
 
   vmap_page_range(caller, mapstart, incpgnum, frm_lst, ret_rg);
+
+  /* The page table holds the frames now */
+  while (frm_lst) {
+    fp = frm_lst;
+    frm_lst = frm_lst->fp_next;
+    free(fp);
+  }
   return 0;
 }
 
  
- /* Swap copy content page from source to destination frame */
+ /* Swap copy content page from source to destination frame,
+  * return the modeled latency of the copy */
  int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                     struct memphy_struct *mpdst, int dstfpn)
  {
-   int cellidx;
-   int addrsrc, addrdst;
- 
-   cellidx = 0;
-   while (cellidx < PAGING_PAGESZ) {
-     addrsrc = srcfpn * PAGING_PAGESZ + cellidx;
-     addrdst = dstfpn * PAGING_PAGESZ + cellidx;
- 
-     BYTE data;
-     MEMPHY_read(mpsrc, addrsrc, &data);
-     MEMPHY_write(mpdst, addrdst, data);
- 
-     cellidx += 1;
-   }
- 
-   return 0;
+   return MEMPHY_copy_frame(mpsrc, srcfpn, mpdst, dstfpn);
  }
  
+ /* Window of each VM area, in eighths of the address space */
+ static const int vma_window[MM_NR_VMA][2] = {
+   [VMA_HEAP]   = {0, 4},
+   [VMA_MMAP]   = {4, 6},
+   [VMA_SHARED] = {6, 7},
+   [VMA_STACK]  = {7, 8},
+ };
+ 
  /* Initialize empty Memory Management instance */
  int init_mm(struct mm_struct *mm, struct pcb_t *caller)
  {
-   struct vm_area_struct *vma = malloc(sizeof(struct vm_area_struct));
-   mm->pgd = malloc(PAGING_MAX_PGN * sizeof(uint32_t));
- 
-   vma->vm_id = 1;
-   vma->vm_start = 0;
-   vma->vm_end = vma->vm_start;
-   vma->sbrk = vma->vm_start;
-   struct vm_rg_struct *first_rg = init_vm_rg(vma->vm_start, vma->vm_end);
-   enlist_vm_rg_node(&vma->vm_freerg_list, first_rg);
- 
-   vma->vm_next = NULL;
-   vma->vm_mm = mm;
-   mm->mmap = vma;
+   unsigned long span = (unsigned long)PAGING_MAX_PGN * PAGING_PAGESZ;
+   struct vm_area_struct **tail = &mm->mmap;
+   pthread_mutexattr_t attr;
+   int i;
+ 
+   mm->pgd = NULL;
+   mm->pt_bytes = 0;
+   memset(&mm->symtbl, 0, sizeof(mm->symtbl));
+   memset(&mm->pgring, 0, sizeof(mm->pgring));
+   memset(mm->slab_partial, 0, sizeof(mm->slab_partial));
+   mm->slab_full = NULL;
+   mm->pid = caller->pid;
+   mm->rss = 0;
+   mm->ra_win = MM_SWAP_RA_MAX / 2;
+   mm->ra_hits = 0;
+ 
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&mm->lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+ 
+   for (i = 0; i < MM_NR_VMA; i++) {
+     struct vm_area_struct *vma = malloc(sizeof(struct vm_area_struct));
+ 
+     vma->vm_id = i;
+     vma->vm_start = span / 8 * vma_window[i][0];
+     vma->vm_end = vma->vm_start;
+     vma->sbrk = vma->vm_start;
+     vma->vm_limit = span / 8 * vma_window[i][1];
+     /* Areas start empty, so do their free lists */
+     vma->vm_freerg_list = NULL;
+     vma->vm_freerg_root = NULL;
+     memset(vma->vm_freebins, 0, sizeof(vma->vm_freebins));
+     vma->vm_freebin_map = 0;
+     vma->swp_type = vma->swp_next = vma->swp_end = 0;
+ 
+     vma->vm_next = NULL;
+     vma->vm_mm = mm;
+     mm->vmas[i] = vma;
+     *tail = vma;
+     tail = &vma->vm_next;
+   }
  
    return 0;
  }
@@ -211,7 +444,9 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend,
    struct vm_rg_struct *rgnode = malloc(sizeof(struct vm_rg_struct));
    rgnode->rg_start = rg_start;
    rgnode->rg_end = rg_end;
-   rgnode->rg_next = NULL;
+   rgnode->rg_next = rgnode->rg_prev = NULL;
+   rgnode->bin_next = rgnode->bin_prev = NULL;
+   rgnode->rg_slab = NULL;
    return rgnode;
  }
  
@@ -222,12 +457,145 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend,
    return 0;
  }
  
- int enlist_pgn_node(struct pgn_t **plist, int pgn)
+ /* Home bucket of @pgn in the slot hash of @r */
+ static int pgring_home(struct pg_ring *r, int pgn)
+ {
+   return ((uint32_t)pgn * 2654435761u) >> (32 - r->hbits);
+ }
+ 
+ /* Bucket holding the slot of @pgn, or the empty one it would go to */
+ static int pgring_bucket(struct pg_ring *r, int pgn)
+ {
+   int mask = (1 << r->hbits) - 1;
+   int h = pgring_home(r, pgn);
+ 
+   while (r->hash[h] >= 0 && r->pgn[r->hash[h]] != pgn)
+     h = (h + 1) & mask;
+   return h;
+ }
+ 
+ /* Empty bucket @h, moving back the entries probed past it */
+ static void pgring_unhash(struct pg_ring *r, int h)
  {
-   struct pgn_t *pnode = malloc(sizeof(struct pgn_t));
-   pnode->pgn = pgn;
-   pnode->pg_next = *plist;
-   *plist = pnode;
+   int mask = (1 << r->hbits) - 1;
+   int i = h, j = h, k;
+ 
+   r->hash[i] = -1;
+   while (r->hash[j = (j + 1) & mask] >= 0) {
+     k = pgring_home(r, r->pgn[r->hash[j]]);
+     /* Keep it if its home lies cyclically in (i, j] */
+     if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+       continue;
+     r->hash[i] = r->hash[j];
+     r->hash[j] = -1;
+     i = j;
+   }
+ }
+ 
+ /* Move the live slots of @r to new arrays of @cap slots */
+ static int pgring_resize(struct pg_ring *r, int cap)
+ {
+   int *pgn = malloc(cap * sizeof(int));
+   uint8_t *age = malloc(cap);
+   int hbits = 1;
+   int *hash;
+   int i, n = 0, hand = 0;
+ 
+   while ((1 << hbits) < 2 * cap)
+     hbits++;
+   hash = malloc(sizeof(int) << hbits);
+   if (pgn == NULL || age == NULL || hash == NULL) {
+     free(pgn);
+     free(age);
+     free(hash);
+     return -1;
+   }
+ 
+   for (i = 0; i < r->count; i++) {
+     int slot = (r->head + i) % r->cap;
+ 
+     if (r->pgn[slot] < 0)
+       continue;
+     if (i < r->hand)
+       hand++;
+     pgn[n] = r->pgn[slot];
+     age[n] = r->age[slot];
+     n++;
+   }
+ 
+   free(r->pgn);
+   free(r->age);
+   free(r->hash);
+   r->pgn = pgn;
+   r->age = age;
+   r->cap = cap;
+   r->head = 0;
+   r->count = n;
+   r->holes = 0;
+   r->hand = hand;
+   r->hash = hash;
+   r->hbits = hbits;
+   memset(hash, 0xff, sizeof(int) << hbits);
+   for (i = 0; i < n; i++)
+     hash[pgring_bucket(r, pgn[i])] = i;
+   return 0;
+ }
+ 
+ /* Drop the holes at both ends of @r */
+ static void pgring_trim(struct pg_ring *r)
+ {
+   while (r->count > 0 && r->pgn[r->head] < 0) {
+     r->head = (r->head + 1) % r->cap;
+     r->count--;
+     r->holes--;
+     if (r->hand > 0)
+       r->hand--;
+   }
+   while (r->count > 0 && r->pgn[(r->head + r->count - 1) % r->cap] < 0) {
+     r->count--;
+     r->holes--;
+   }
+ }
+ 
+ /* Append @pgn as the newest resident page */
+ int pgring_push(struct pg_ring *r, int pgn)
+ {
+   int slot;
+ 
+   if (r->count == r->cap &&
+       pgring_resize(r, r->holes > r->cap / 2 ? r->cap :
+                        (r->cap ? 2 * r->cap : 64)) < 0)
+     return -1;
+ 
+   slot = (r->head + r->count) % r->cap;
+   r->hash[pgring_bucket(r, pgn)] = slot;
+   r->pgn[slot] = pgn;
+   r->age[slot] = 0;
+   r->count++;
+   return 0;
+ }
+ 
+ /* Drop @pgn from @r, if there */
+ int pgring_remove(struct pg_ring *r, int pgn)
+ {
+   int h, slot;
+ 
+   if (r->cap == 0 || (slot = r->hash[h = pgring_bucket(r, pgn)]) < 0)
+     return -1;
+ 
+   pgring_unhash(r, h);
+   r->pgn[slot] = -1;
+   r->holes++;
+   pgring_trim(r);
+   return 0;
+ }
+ 
+ int pgring_free(struct pg_ring *r)
+ {
+   free(r->pgn);
+   free(r->age);
+   free(r->hash);
+   memset(r, 0, sizeof(*r));
    return 0;
  }
  
@@ -273,19 +641,6 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend,
    return 0;
  }
  
- int print_list_pgn(struct pgn_t *ip)
- {
-   printf("print_list_pgn: ");
-   if (ip == NULL) { printf("NULL list\n"); return -1; }
-   printf("\n");
-   while (ip != NULL) {
-     printf("va[%d]-\n", ip->pgn);
-     ip = ip->pg_next;
-   }
-   printf("n");
-   return 0;
- }
- 
  int print_pgtbl(struct pcb_t *caller, uint32_t start, uint32_t end)
  {
    int pgn_start, pgn_end;
@@ -312,7 +667,8 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend,
  
    pgit = pgn_start;
    while (pgit < pgn_end) {
-     printf("%08ld: %08x\n", (long)(pgit * sizeof(uint32_t)), caller->mm->pgd[pgit]);
+     uint32_t *pte = pte_lookup(caller->mm, pgit);
+     printf("%08ld: %08x\n", (long)(pgit * sizeof(uint32_t)), pte ? *pte : 0);
      pgit += 1;
    }
  
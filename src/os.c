@@ -9,34 +9,71 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
 
 static int time_slot;
 static int num_cpus;
 static int done = 0;
+static int cpus_running; /* CPUs not stopped yet */
 
 #ifdef MM_PAGING
 // #undef MM_PAGING
 
 static int memramsz;
 static int memswpsz[PAGING_MAX_MMSWP];
+static char memswp_path[PAGING_MAX_MMSWP][100]; /* Empty: host memory */
+#ifdef MEMSWP_SEQUENTIAL
+static int memswp_seq = 1;
+#else
+static int memswp_seq = 0;
+#endif
 struct mmpaging_ld_args {
 	/* A dispatched argument struct to compact many-fields passing to loader */
 	int vmemsz;
 	struct memphy_struct *mram;
-	struct memphy_struct **mswp;
-	struct memphy_struct *active_mswp;
-	int active_mswp_id;
+	struct memphy_struct *mswp; /* PAGING_MAX_MMSWP devices */
 	struct timer_id_t  *timer_id;
 };
+
+struct kswapd_args {
+	struct timer_id_t * timer_id;
+	struct memphy_struct * mram;
+	struct memphy_struct * mswp; /* PAGING_MAX_MMSWP devices */
+};
 #endif
 
-static struct ld_args{
-	char ** path;
-	unsigned long * start_time;
+/* A process arrival, as read from the config or an arrival stream */
+struct ld_entry {
+	unsigned long start_time;
+	char path[100];
 #ifdef MLQ_SCHED
-	unsigned long * prio;
+	unsigned long prio;
 #endif
-} ld_processes;
+	struct pcb_t * proc; /* Set once a loader worker has prepared it */
+	int failed;          /* Or set if it could not be loaded */
+};
+
+#define LD_GEN_MAX 16
+
+/* Arrival source. Arrivals are pulled lazily from the config, from a
+ * stream file or FIFO, or from a built-in generator, so memory does not
+ * grow with the number of processes flowing through */
+static struct {
+	FILE * file;     /* Config or stream the arrivals are read from */
+	char path[100];  /* Stream to open on first use */
+	int live;        /* A FIFO: arrivals show up as they are written */
+	int gen_nprog;   /* Built-in generator when not 0 */
+	double gen_rate; /* Generated arrivals per time slot */
+	char gen_path[LD_GEN_MAX][88];
+	unsigned long gen_prio[LD_GEN_MAX];
+	unsigned long count;     /* Arrivals produced so far */
+	unsigned long max_procs; /* Limits, 0 means unbounded */
+	unsigned long max_slots;
+	pthread_mutex_t lock;
+} ld_src = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 int num_processes;
 
 struct cpu_args {
@@ -48,6 +85,9 @@ struct cpu_args {
 static void * cpu_routine(void * args) {
 	struct timer_id_t * timer_id = ((struct cpu_args*)args)->timer_id;
 	int id = ((struct cpu_args*)args)->id;
+#ifdef MM_PAGING
+	MEMPHY_set_cpu(id);
+#endif
 	/* Check for new process in ready queue */
 	int time_left = 0;
 	struct pcb_t * proc = NULL;
@@ -57,14 +97,13 @@ static void * cpu_routine(void * args) {
 			/* No process is running, the we load new process from
 		 	* ready queue */
 			proc = get_proc();
-			if (proc == NULL) {
-                           next_slot(timer_id);
-                           continue; /* First load failed. skip dummy load */
-                        }
-		}else if (proc->pc == proc->code->size) {
-			/* The porcess has finish it job */
+		}else if (proc->pc >= proc->code->size ||
+			  __atomic_load_n(&proc->killed, __ATOMIC_ACQUIRE)) {
+			/* The porcess has finish it job, or was killed */
 			printf("\tCPU %d: Processed %2d has finished\n",
 				id ,proc->pid);
+			drop_proc(proc);
+			terminate_process(proc);
 			free(proc);
 			proc = get_proc();
 			time_left = 0;
@@ -80,6 +119,7 @@ static void * cpu_routine(void * args) {
 		if (proc == NULL && done) {
 			/* No process to run, exit */
 			printf("\tCPU %d stopped\n", id);
+			__sync_fetch_and_sub(&cpus_running, 1);
 			break;
 		}else if (proc == NULL) {
 			/* There may be new processes to run in
@@ -92,6 +132,19 @@ static void * cpu_routine(void * args) {
 			time_left = time_slot;
 		}
 		
+#ifdef MM_PAGING
+		/* A process waiting on a slow memory device spends its
+		 * time slots stalled rather than running */
+		if (proc->io_stall >= MEMPHY_COST_PER_SLOT) {
+			printf("\tCPU %d: Process %2d stalled on memory device\n",
+				id, proc->pid);
+			proc->io_stall -= MEMPHY_COST_PER_SLOT;
+			time_left--;
+			next_slot(timer_id);
+			continue;
+		}
+#endif
+
 		/* Run current process */
 		run(proc);
 		time_left--;
@@ -101,56 +154,420 @@ static void * cpu_routine(void * args) {
 	pthread_exit(NULL);
 }
 
-static void * ld_routine(void * args) {
 #ifdef MM_PAGING
-	struct memphy_struct* mram = ((struct mmpaging_ld_args *)args)->mram;
-	struct memphy_struct** mswp = ((struct mmpaging_ld_args *)args)->mswp;
-	struct memphy_struct* active_mswp = ((struct mmpaging_ld_args *)args)->active_mswp;
-	struct timer_id_t * timer_id = ((struct mmpaging_ld_args *)args)->timer_id;
-#else
-	struct timer_id_t * timer_id = (struct timer_id_t*)args;
+/* Background reclaim, a device of its own on the timer. It keeps free
+ * RAM frames between the watermarks while the CPUs run, spending time
+ * slots on its own writes to slow swap devices, and ages the frames
+ * once per slot for global AGING */
+static void * kswapd_routine(void * args) {
+	struct kswapd_args * kargs = (struct kswapd_args *)args;
+	uint32_t io_stall = 0;
+
+	while (__atomic_load_n(&cpus_running, __ATOMIC_ACQUIRE) > 0) {
+		if (io_stall >= MEMPHY_COST_PER_SLOT) {
+			io_stall -= MEMPHY_COST_PER_SLOT;
+		}else{
+			mm_kswapd(kargs->mram, kargs->mswp, &io_stall);
+		}
+		next_slot(kargs->timer_id);
+	}
+	detach_event(kargs->timer_id);
+	pthread_exit(NULL);
+}
 #endif
-	int i = 0;
-	printf("ld_routine\n");
-	while (i < num_processes) {
-		struct pcb_t * proc = load(ld_processes.path[i]);
+
+/* Get the next arrival from the source. Return 0 on success, or -1
+ * when the source is exhausted or a limit has been reached */
+static int ld_fetch(struct ld_entry * e) {
+	char proc[88];
+
+	if (ld_src.max_procs != 0 && ld_src.count >= ld_src.max_procs) {
+		return -1;
+	}
+	if (ld_src.gen_nprog > 0) {
+		int k = ld_src.count % ld_src.gen_nprog;
+		e->start_time = (unsigned long)(ld_src.count / ld_src.gen_rate);
+		snprintf(proc, sizeof(proc), "%s", ld_src.gen_path[k]);
 #ifdef MLQ_SCHED
-		proc->prio = ld_processes.prio[i];
+		e->prio = ld_src.gen_prio[k];
 #endif
-		while (current_time() < ld_processes.start_time[i]) {
-			next_slot(timer_id);
+	}else{
+		if (ld_src.file == NULL &&
+		    (ld_src.file = fopen(ld_src.path, "r")) == NULL) {
+			printf("Cannot open arrival stream at %s\n", ld_src.path);
+			return -1;
 		}
+#ifdef MLQ_SCHED
+		if (fscanf(ld_src.file, "%lu %87s %lu\n",
+			   &e->start_time, proc, &e->prio) != 3) {
+#else
+		if (fscanf(ld_src.file, "%lu %87s\n", &e->start_time, proc) != 2) {
+#endif
+			return -1;
+		}
+	}
+	if (ld_src.max_slots != 0 && e->start_time >= ld_src.max_slots) {
+		return -1;
+	}
+	snprintf(e->path, sizeof(e->path), "input/proc/%s", proc);
+	ld_src.count++;
+	return 0;
+}
+
+/* Loader pipeline: LD_WORKERS host threads pull arrivals from the
+ * source and initialize them, at most LD_WINDOW arrivals ahead of the
+ * timeline. ld_routine then only waits for the start time and
+ * enqueues, so file I/O never delays an arrival slot. */
+static struct {
+	struct ld_entry slot[LD_WINDOW]; /* Arrival i is kept in i % LD_WINDOW */
+	unsigned long next;     /* Arrivals claimed by workers */
+	unsigned long consumed; /* Arrivals handed to the scheduler */
+	int eof;  /* No arrival after [next] */
+	int stop; /* The timeline does not take arrivals anymore */
+	pthread_mutex_t lock;
+	pthread_cond_t window_cond;
+	pthread_cond_t ready_cond;
+} ld_pipe = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.window_cond = PTHREAD_COND_INITIALIZER,
+	.ready_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void * ld_worker(void * args) {
+#ifdef MM_PAGING
+	struct mmpaging_ld_args * mm_args = (struct mmpaging_ld_args *)args;
+#endif
+	while (1) {
+		struct ld_entry e;
+		unsigned long i;
+		int stop;
+
+		/* Arrivals are fetched and numbered in source order. The
+		 * source is not held while waiting for room in the window */
+		pthread_mutex_lock(&ld_src.lock);
+		pthread_mutex_lock(&ld_pipe.lock);
+		if (!ld_pipe.stop && !ld_pipe.eof &&
+		    ld_pipe.next >= ld_pipe.consumed + LD_WINDOW) {
+			pthread_mutex_unlock(&ld_src.lock);
+			pthread_cond_wait(&ld_pipe.window_cond, &ld_pipe.lock);
+			pthread_mutex_unlock(&ld_pipe.lock);
+			continue;
+		}
+		stop = ld_pipe.stop || ld_pipe.eof;
+		pthread_mutex_unlock(&ld_pipe.lock);
+		if (stop || ld_fetch(&e) != 0) {
+			pthread_mutex_lock(&ld_pipe.lock);
+			ld_pipe.eof = 1;
+			pthread_cond_broadcast(&ld_pipe.ready_cond);
+			pthread_mutex_unlock(&ld_pipe.lock);
+			pthread_mutex_unlock(&ld_src.lock);
+			break;
+		}
+		uint32_t pid = alloc_pid();
+		e.proc = NULL;
+		e.failed = 0;
+		pthread_mutex_lock(&ld_pipe.lock);
+		i = ld_pipe.next++;
+		ld_pipe.slot[i % LD_WINDOW] = e;
+		pthread_cond_broadcast(&ld_pipe.ready_cond);
+		pthread_mutex_unlock(&ld_pipe.lock);
+		pthread_mutex_unlock(&ld_src.lock);
+
+		struct pcb_t * proc = load_pid(e.path, pid);
+		if (proc == NULL) {
+			/* The timeline skips it, giving its window slot back */
+			pthread_mutex_lock(&ld_pipe.lock);
+			ld_pipe.slot[i % LD_WINDOW].failed = 1;
+			pthread_cond_broadcast(&ld_pipe.ready_cond);
+			pthread_mutex_unlock(&ld_pipe.lock);
+			continue;
+		}
+#ifdef MLQ_SCHED
+		proc->prio = e.prio;
+#endif
 #ifdef MM_PAGING
 		proc->mm = malloc(sizeof(struct mm_struct));
 		init_mm(proc->mm, proc);
-		proc->mram = mram;
-		proc->mswp = mswp;
-		proc->active_mswp = active_mswp;
+		proc->mram = mm_args->mram;
+		proc->mswp = mm_args->mswp;
+		proc->io_stall = 0;
+#endif
+		pthread_mutex_lock(&ld_pipe.lock);
+		ld_pipe.slot[i % LD_WINDOW].proc = proc;
+		pthread_cond_broadcast(&ld_pipe.ready_cond);
+		pthread_mutex_unlock(&ld_pipe.lock);
+	}
+	pthread_exit(NULL);
+}
+
+static void * ld_routine(void * args) {
+#ifdef MM_PAGING
+	struct timer_id_t * timer_id = ((struct mmpaging_ld_args *)args)->timer_id;
+#else
+	struct timer_id_t * timer_id = (struct timer_id_t*)args;
 #endif
+	pthread_t worker;
+	unsigned long i;
+	for (i = 0; i < LD_WORKERS; i++) {
+		/* A worker may sit on an idle FIFO, nobody waits for it */
+		pthread_create(&worker, NULL, ld_worker, args);
+		pthread_detach(worker);
+	}
+
+	i = 0;
+	printf("ld_routine\n");
+	while (1) {
+		struct ld_entry * e = &ld_pipe.slot[i % LD_WINDOW];
+		struct ld_entry arrival;
+
+		/* Wait until the next arrival is known */
+		pthread_mutex_lock(&ld_pipe.lock);
+		while (i >= ld_pipe.next && !ld_pipe.eof && !ld_src.live) {
+			pthread_cond_wait(&ld_pipe.ready_cond, &ld_pipe.lock);
+		}
+		if (i >= ld_pipe.next && !ld_pipe.eof) {
+			/* An idle FIFO holds each slot for a while, so that the
+			 * writer is not outrun by the simulation */
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += LD_FIFO_IDLE_MS * 1000000L;
+			ts.tv_sec += ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&ld_pipe.ready_cond, &ld_pipe.lock, &ts);
+		}
+		if (i >= ld_pipe.next) {
+			int eof = ld_pipe.eof;
+			pthread_mutex_unlock(&ld_pipe.lock);
+			if (eof || (ld_src.max_slots != 0 &&
+				    current_time() >= ld_src.max_slots)) {
+				break;
+			}
+			/* Nothing written to the FIFO yet, time goes on */
+			next_slot(timer_id);
+			continue;
+		}
+		unsigned long start_time = e->start_time;
+		pthread_mutex_unlock(&ld_pipe.lock);
+
+		while (current_time() < start_time) {
+			next_slot(timer_id);
+		}
+
+		pthread_mutex_lock(&ld_pipe.lock);
+		while (e->proc == NULL && !e->failed) {
+			pthread_cond_wait(&ld_pipe.ready_cond, &ld_pipe.lock);
+		}
+		arrival = *e;
+		e->proc = NULL;
+		ld_pipe.consumed++;
+		pthread_cond_broadcast(&ld_pipe.window_cond);
+		pthread_mutex_unlock(&ld_pipe.lock);
+		if (arrival.failed) {
+			printf("\tSkipped process at %s, it cannot be loaded\n",
+				arrival.path);
+			i++;
+			continue;
+		}
+
+#ifdef MLQ_SCHED
 		printf("\tLoaded a process at %s, PID: %d PRIO: %ld\n",
-			ld_processes.path[i], proc->pid, ld_processes.prio[i]);
-		add_proc(proc);
-		free(ld_processes.path[i]);
+			arrival.path, arrival.proc->pid, arrival.prio);
+#else
+		printf("\tLoaded a process at %s, PID: %d\n",
+			arrival.path, arrival.proc->pid);
+#endif
+		if (add_proc(arrival.proc) != 0) {
+			/* No queue room left: free it rather than leak it */
+			printf("\tRejected process %d: scheduler queues full\n",
+				arrival.proc->pid);
+			terminate_process(arrival.proc);
+			free(arrival.proc);
+		}
 		i++;
 		next_slot(timer_id);
 	}
-	free(ld_processes.path);
-	free(ld_processes.start_time);
+
+	pthread_mutex_lock(&ld_pipe.lock);
+	ld_pipe.stop = 1;
+	pthread_cond_broadcast(&ld_pipe.window_cond);
+	pthread_mutex_unlock(&ld_pipe.lock);
 	done = 1;
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
 
+/* Parse a config directive line:
+ *   stream file <path>           arrivals read lazily from a file
+ *   stream fifo <path>           arrivals written to a FIFO at run time
+ *   stream gen <rate> <prog> <prio> [<prog> <prio>]...
+ *                                <rate> arrivals per slot cycling over
+ *                                the given programs
+ *   limit <slots> <processes>    stop arrivals at a slot or a count,
+ *                                0 means unbounded
+ *   swapfile <id> <path>         back MEMSWP<id> with a file on disk,
+ *                                created for the run and removed after,
+ *                                so it must not exist yet
+ *   swapprio <id> <prio>         priority of MEMSWP<id>: swap goes to
+ *                                the highest one with room, striped
+ *                                over equals; by default in id order
+ *   replace local|global [fifo|second|clock|aging]
+ *                                page replacement scope and policy
+ *   slab on|off                  small allocations from slabs or not
+ *   mmcheck on|off               check the paging state after each
+ *                                memory operation
+ *   wmark <low> <high>           free RAM frames waking kswapd and
+ *                                putting it back to sleep, 0 0 for none
+ *   swapseq on|off               swap devices sequential, with a
+ *                                latency and one transfer at a time,
+ *                                or random access
+ */
+static const char * directives[] = {
+	"stream", "limit", "swapfile", "swapprio", "replace", "slab",
+	"mmcheck", "wmark", "swapseq",
+};
+
+/* Whether [line] starts with a directive keyword */
+static int is_directive(const char * line) {
+	size_t i, len = strcspn(line, " \t\n");
+
+	for (i = 0; i < sizeof(directives) / sizeof(directives[0]); i++) {
+		if (strlen(directives[i]) == len &&
+		    !strncmp(line, directives[i], len)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void read_directive(char * line) {
+	char * tok = strtok(line, " \t\n");
+	char * arg;
+
+	if (tok == NULL) {
+		return;
+	}
+	if (!strcmp(tok, "limit")) {
+		arg = strtok(NULL, " \t\n");
+		ld_src.max_slots = arg ? strtoul(arg, NULL, 10) : 0;
+		arg = strtok(NULL, " \t\n");
+		ld_src.max_procs = arg ? strtoul(arg, NULL, 10) : 0;
+		return;
+	}
+#ifdef MM_PAGING
+	if (!strcmp(tok, "swapfile")) {
+		int id;
+		arg = strtok(NULL, " \t\n");
+		id = arg ? atoi(arg) : -1;
+		if (id < 0 || id >= PAGING_MAX_MMSWP ||
+		    (arg = strtok(NULL, " \t\n")) == NULL) {
+			printf("Invalid swap file directive\n");
+			exit(1);
+		}
+		snprintf(memswp_path[id], sizeof(memswp_path[id]), "%s", arg);
+		return;
+	}
+	if (!strcmp(tok, "swapprio")) {
+		char * prio;
+		arg = strtok(NULL, " \t\n");
+		prio = strtok(NULL, " \t\n");
+		if (arg == NULL || prio == NULL ||
+		    mm_set_swap_prio(atoi(arg), atoi(prio)) < 0) {
+			printf("Invalid swap priority directive\n");
+			exit(1);
+		}
+		return;
+	}
+	if (!strcmp(tok, "replace")) {
+		arg = strtok(NULL, " \t\n");
+		if (arg == NULL ||
+		    mm_set_replace(arg, strtok(NULL, " \t\n")) < 0) {
+			printf("Invalid page replacement directive\n");
+			exit(1);
+		}
+		return;
+	}
+	if (!strcmp(tok, "slab")) {
+		arg = strtok(NULL, " \t\n");
+		if (arg == NULL || mm_set_slab(arg) < 0) {
+			printf("Invalid slab directive\n");
+			exit(1);
+		}
+		return;
+	}
+	if (!strcmp(tok, "wmark")) {
+		char * high;
+		arg = strtok(NULL, " \t\n");
+		high = strtok(NULL, " \t\n");
+		if (arg == NULL || high == NULL ||
+		    mm_set_wmark(atoi(arg), atoi(high)) < 0) {
+			printf("Invalid watermark directive\n");
+			exit(1);
+		}
+		return;
+	}
+	if (!strcmp(tok, "mmcheck")) {
+		arg = strtok(NULL, " \t\n");
+		if (arg == NULL || mm_set_check(arg) < 0) {
+			printf("Invalid mmcheck directive\n");
+			exit(1);
+		}
+		return;
+	}
+	if (!strcmp(tok, "swapseq")) {
+		arg = strtok(NULL, " \t\n");
+		if (arg == NULL || (strcmp(arg, "on") && strcmp(arg, "off"))) {
+			printf("Invalid swapseq directive\n");
+			exit(1);
+		}
+		memswp_seq = !strcmp(arg, "on");
+		return;
+	}
+#endif
+	if (strcmp(tok, "stream") || (tok = strtok(NULL, " \t\n")) == NULL) {
+		printf("Unknown config directive %s\n", line);
+		exit(1);
+	}
+	if (!strcmp(tok, "file") || !strcmp(tok, "fifo")) {
+		if ((arg = strtok(NULL, " \t\n")) == NULL) {
+			printf("Missing path of arrival stream\n");
+			exit(1);
+		}
+		snprintf(ld_src.path, sizeof(ld_src.path), "%s", arg);
+		if (!strcmp(tok, "fifo")) {
+			/* It is fine for the FIFO to exist already */
+			mkfifo(ld_src.path, 0644);
+			ld_src.live = 1;
+		}
+	}else if (!strcmp(tok, "gen")) {
+		arg = strtok(NULL, " \t\n");
+		ld_src.gen_rate = arg ? atof(arg) : 0;
+		while ((arg = strtok(NULL, " \t\n")) != NULL &&
+		       ld_src.gen_nprog < LD_GEN_MAX) {
+			int k = ld_src.gen_nprog++;
+			snprintf(ld_src.gen_path[k], sizeof(ld_src.gen_path[k]),
+				"%s", arg);
+			arg = strtok(NULL, " \t\n");
+			ld_src.gen_prio[k] = arg ? strtoul(arg, NULL, 10) : 0;
+		}
+		if (ld_src.gen_rate <= 0 || ld_src.gen_nprog == 0) {
+			printf("Invalid arrival generator\n");
+			exit(1);
+		}
+	}else{
+		printf("Unknown arrival stream %s\n", tok);
+		exit(1);
+	}
+}
+
 static void read_config(const char * path) {
 	FILE * file;
+	long pos;
+	char line[512];
 	if ((file = fopen(path, "r")) == NULL) {
 		printf("Cannot find configure file at %s\n", path);
 		exit(1);
 	}
 	fscanf(file, "%d %d %d\n", &time_slot, &num_cpus, &num_processes);
-	ld_processes.path = (char**)malloc(sizeof(char*) * num_processes);
-	ld_processes.start_time = (unsigned long*)
-		malloc(sizeof(unsigned long) * num_processes);
 #ifdef MM_PAGING
 	int sit;
 #ifdef MM_FIXED_MEMSZ
@@ -168,32 +585,79 @@ static void read_config(const char * path) {
 	 * Format: (size=0 result non-used memswap, must have RAM and at least 1 SWAP)
 	 *        MEM_RAM_SZ MEM_SWP0_SZ MEM_SWP1_SZ MEM_SWP2_SZ MEM_SWP3_SZ
 	*/
-	fscanf(file, "%d\n", &memramsz);
-	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-		fscanf(file, "%d", &(memswpsz[sit])); 
-
-       fscanf(file, "\n"); /* Final character */
+	char * p = line;
+	int off, n = 0;
+	pos = ftell(file);
+	if (fgets(line, sizeof(line), file) != NULL &&
+	    sscanf(p, "%d%n", &memramsz, &off) == 1) {
+		for (n = 1, p += off; n <= PAGING_MAX_MMSWP &&
+		     sscanf(p, "%d%n", &(memswpsz[n - 1]), &off) == 1; n++)
+			p += off;
+	}
+	if (n <= PAGING_MAX_MMSWP) {
+		/* A legacy config, its second line is a process already */
+		memramsz    =  0x100000;
+		memswpsz[0] = 0x1000000;
+		for(sit = 1; sit < PAGING_MAX_MMSWP; sit++)
+			memswpsz[sit] = 0;
+		fseek(file, pos, SEEK_SET);
+	}
 #endif
 #endif
 
-#ifdef MLQ_SCHED
-	ld_processes.prio = (unsigned long*)
-		malloc(sizeof(unsigned long) * num_processes);
-#endif
-	int i;
-	for (i = 0; i < num_processes; i++) {
-		ld_processes.path[i] = (char*)malloc(sizeof(char) * 100);
-		ld_processes.path[i][0] = '\0';
-		strcat(ld_processes.path[i], "input/proc/");
-		char proc[100];
-#ifdef MLQ_SCHED
-		fscanf(file, "%lu %s %lu\n", &ld_processes.start_time[i], proc, &ld_processes.prio[i]);
-#else
-		fscanf(file, "%lu %s\n", &ld_processes.start_time[i], proc);
-#endif
-		strcat(ld_processes.path[i], proc);
+	/* Directives come before the process list, one per line. The
+	 * first other line is left to be read as a process */
+	int c;
+	while ((c = fgetc(file)) != EOF) {
+		if (c == ' ' || c == '\t' || c == '\n') {
+			continue;
+		}
+		ungetc(c, file);
+		pos = ftell(file);
+		if (fgets(line, sizeof(line), file) == NULL) {
+			break;
+		}
+		if (!is_directive(line)) {
+			fseek(file, pos, SEEK_SET);
+			break;
+		}
+		read_directive(line);
+	}
+
+	/* Without a stream, the remaining lines of the config are the
+	 * [num_processes] arrivals. A stream runs until its end or a limit,
+	 * with [num_processes] as process limit when not 0 */
+	if (ld_src.path[0] == '\0' && ld_src.gen_nprog == 0) {
+		ld_src.file = file;
+		if (ld_src.max_procs == 0 || ld_src.max_procs > num_processes) {
+			ld_src.max_procs = num_processes;
+		}
+	}else{
+		fclose(file);
+		if (ld_src.max_procs == 0) {
+			ld_src.max_procs = num_processes;
+		}
+	}
+}
+
+#ifdef MM_PAGING
+/* Once every process is gone, every frame of [mp] must be free again.
+ * Return the number of frames still in use */
+static int check_released(struct memphy_struct * mp, const char * name) {
+	struct memphy_fragstat st;
+
+	/* Frames left in the CPU caches are free */
+	MEMPHY_drain_pcp(mp);
+	MEMPHY_check(mp, name);
+	MEMPHY_get_fragstat(mp, &st);
+	if (st.nfree != st.numfp) {
+		printf("%s: %d frames not released\n", name,
+			st.numfp - st.nfree);
+		MEMPHY_dump_frames(mp, name);
 	}
+	return st.numfp - st.nfree;
 }
+#endif
 
 int main(int argc, char * argv[]) {
 	/* Read config */
@@ -219,6 +683,12 @@ int main(int argc, char * argv[]) {
 		args[i].id = i;
 	}
 	struct timer_id_t * ld_event = attach_event();
+#ifdef MM_PAGING
+	pthread_t kswapd;
+	struct kswapd_args kswapd_args;
+	kswapd_args.timer_id = mm_kswapd_needed() ? attach_event() : NULL;
+#endif
+	cpus_running = num_cpus;
 	start_timer();
 
 #ifdef MM_PAGING
@@ -229,21 +699,27 @@ int main(int argc, char * argv[]) {
 	struct memphy_struct mswp[PAGING_MAX_MMSWP];
 
 	/* Create MEM RAM */
-	init_memphy(&mram, memramsz, rdmflag);
+	if (init_memphy(&mram, memramsz, rdmflag) < 0)
+		exit(1);
 
         /* Create all MEM SWAP */ 
 	int sit;
+	if (memswp_seq)
+		rdmflag = 0;
 	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-	       init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+	       if (init_memphy_backed(&mswp[sit], memswpsz[sit], rdmflag,
+	                   memswp_path[sit][0] ? memswp_path[sit] : NULL) < 0)
+	               exit(1);
 
 	/* In Paging mode, it needs passing the system mem to each PCB through loader*/
 	struct mmpaging_ld_args *mm_ld_args = malloc(sizeof(struct mmpaging_ld_args));
 
 	mm_ld_args->timer_id = ld_event;
 	mm_ld_args->mram = (struct memphy_struct *) &mram;
-	mm_ld_args->mswp = (struct memphy_struct**) &mswp;
-	mm_ld_args->active_mswp = (struct memphy_struct *) &mswp[0];
-        mm_ld_args->active_mswp_id = 0;
+	mm_ld_args->mswp = mswp;
+
+	kswapd_args.mram = &mram;
+	kswapd_args.mswp = mswp;
 #endif
 
 	/* Init scheduler */
@@ -259,17 +735,48 @@ int main(int argc, char * argv[]) {
 		pthread_create(&cpu[i], NULL,
 			cpu_routine, (void*)&args[i]);
 	}
+#ifdef MM_PAGING
+	if (kswapd_args.timer_id != NULL) {
+		pthread_create(&kswapd, NULL, kswapd_routine, &kswapd_args);
+	}
+#endif
 
 	/* Wait for CPU and loader finishing */
 	for (i = 0; i < num_cpus; i++) {
 		pthread_join(cpu[i], NULL);
 	}
 	pthread_join(ld, NULL);
+#ifdef MM_PAGING
+	if (kswapd_args.timer_id != NULL) {
+		pthread_join(kswapd, NULL);
+	}
+#endif
 
 	/* Stop timer */
 	stop_timer();
 
-	return 0;
+	int leaked = 0;
+#ifdef MM_PAGING
+	leaked += check_released(&mram, "MEMRAM");
+	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++) {
+		char name[16];
+		snprintf(name, sizeof(name), "MEMSWP%d", sit);
+		leaked += check_released(&mswp[sit], name);
+	}
+	MEMPHY_dump_fragstat(&mram, "MEMRAM");
+	mm_dump_stat();
+#ifdef MMDBG
+	MEMPHY_dump_frames(&mram, "MEMRAM");
+#endif
+	free_memphy(&mram);
+	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+		free_memphy(&mswp[sit]);
+	free(mm_ld_args);
+#endif
+	free(cpu);
+	free(args);
+
+	return leaked ? 1 : 0;
 
 }
 
@@ -0,0 +1,39 @@
+
+/* oscc - compile text process programs into binary images
+ * Usage: oscc [-o output] program...
+ * Without -o, each program is compiled to program.img next to it,
+ * which is the same file the loader cache looks for. */
+
+#include "loader.h"
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char * argv[]) {
+	const char * out = NULL;
+	char dst[256];
+	int i = 1;
+	int ret = 0;
+
+	if (argc > 2 && !strcmp(argv[1], "-o")) {
+		out = argv[2];
+		i = 3;
+	}
+	if (i >= argc || (out != NULL && argc - i != 1)) {
+		printf("Usage: oscc [-o output] program...\n");
+		return 1;
+	}
+
+	for (; i < argc; i++) {
+		if (out != NULL)
+			snprintf(dst, sizeof(dst), "%s", out);
+		else
+			snprintf(dst, sizeof(dst), "%s%s", argv[i], IMG_SUFFIX);
+		if (compile_image(argv[i], dst) != 0) {
+			printf("Cannot write image of '%s' to '%s'\n", argv[i], dst);
+			ret = 1;
+			continue;
+		}
+		printf("%s -> %s\n", argv[i], dst);
+	}
+	return ret;
+}
@@ -0,0 +1,342 @@
+
+/* oswl - synthetic workload generator
+ * Emits a config file input/<name> and a pool of process programs under
+ * input/proc/<name>/. Everything is derived from the seed, so the same
+ * parameters always produce byte-identical files.
+ *
+ * Usage: oswl [options]
+ *   -o name      workload name                         (default wl)
+ *   -s seed      PRNG seed                             (default 1)
+ *   -n count     number of processes                   (default 100)
+ *   -P programs  number of distinct programs           (default 16)
+ *   -L length    instructions per program              (default 50)
+ *   -a dist      arrivals: uniform, poisson or bursty  (default poisson)
+ *   -r rate      mean arrivals per time slot           (default 0.03)
+ *   -b burst     mean burst size for bursty arrivals   (default 8)
+ *   -p mix       priority mix prio:weight,...          (default 0:1,20:2,120:4)
+ *   -m mix       instruction mix calc:w,alloc:w,read:w,write:w,syscall:w
+ *                                                      (default 40,10,20,20,10)
+ *   -w pages     working set per process, in pages     (default 8)
+ *   -z bytes     region size instead of the working set split
+ *   -l percent   access locality, 0 = uniform          (default 80)
+ *   -t slot      time slot of the config               (default 2)
+ *   -c cpus      number of CPUs of the config          (default 4)
+ *   -R ram       MEMRAM size of the config             (default 2097152)
+ *   -S swap      MEMSWP0 size of the config            (default 16777216)
+ */
+
+#include "mm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define WL_MAX_MIX	16
+#define WL_MAX_REGION	8	/* Regions double as READ destinations */
+#define WL_SYSCALL	440	/* sys_xxxhandler, no side effect */
+
+enum wl_ins { WL_CALC, WL_ALLOC, WL_READ, WL_WRITE, WL_SYSCALL_OP, WL_NINS };
+
+static const char * wl_ins_name[WL_NINS] = {
+	"calc", "alloc", "read", "write", "syscall"
+};
+
+struct wl_mix {
+	int n;
+	long val[WL_MAX_MIX];
+	long weight[WL_MAX_MIX];
+	long total;
+};
+
+static uint64_t rng_state;
+
+/* splitmix64, fixed across platforms unlike rand() */
+static uint64_t rng_next(void) {
+	uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n) */
+static long rng_below(long n) {
+	return n <= 0 ? 0 : (long)(rng_next() % (uint64_t)n);
+}
+
+/* Uniform in (0, 1] */
+static double rng_unit(void) {
+	return ((rng_next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static double rng_exp(double mean) {
+	return -mean * log(rng_unit());
+}
+
+static long mix_pick(struct wl_mix * mix) {
+	long r = rng_below(mix->total);
+	int i;
+	for (i = 0; i < mix->n - 1 && r >= mix->weight[i]; i++) {
+		r -= mix->weight[i];
+	}
+	return mix->val[i];
+}
+
+/* Parse "v:w,v:w,..." (or plain "w,w,..." when [names] are given, in
+ * which case entries may also be "name:w") */
+static int parse_mix(const char * arg, struct wl_mix * mix,
+		const char ** names, int nnames) {
+	char buf[256];
+	char * tok;
+	char * sep;
+	int i;
+
+	snprintf(buf, sizeof(buf), "%s", arg);
+	mix->n = 0;
+	mix->total = 0;
+	for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (mix->n == WL_MAX_MIX) {
+			return -1;
+		}
+		sep = strchr(tok, ':');
+		if (sep == NULL && names != NULL) {
+			mix->val[mix->n] = mix->n;
+			mix->weight[mix->n] = atol(tok);
+		}else if (sep == NULL) {
+			return -1;
+		}else{
+			*sep = '\0';
+			mix->val[mix->n] = -1;
+			for (i = 0; names != NULL && i < nnames; i++) {
+				if (!strcmp(tok, names[i])) {
+					mix->val[mix->n] = i;
+				}
+			}
+			if (names == NULL) {
+				mix->val[mix->n] = atol(tok);
+			}else if (mix->val[mix->n] < 0) {
+				return -1;
+			}
+			mix->weight[mix->n] = atol(sep + 1);
+		}
+		if (mix->weight[mix->n] < 0) {
+			return -1;
+		}
+		mix->total += mix->weight[mix->n];
+		mix->n++;
+	}
+	return mix->total > 0 ? 0 : -1;
+}
+
+/* Pick an offset in a region of [size] bytes, close to [last] with
+ * probability [locality]% */
+static long pick_offset(long size, long last, int locality) {
+	if (last >= 0 && rng_below(100) < locality) {
+		long off = last + rng_below(2 * PAGING_PAGESZ / 8 + 1)
+			- PAGING_PAGESZ / 8;
+		if (off >= 0 && off < size) {
+			return off;
+		}
+	}
+	return rng_below(size);
+}
+
+static int gen_program(const char * path, long prio, int length,
+		struct wl_mix * ins_mix, int ws_pages, long rg_bytes,
+		int locality) {
+	FILE * file;
+	int nrg = ws_pages < WL_MAX_REGION ? ws_pages : WL_MAX_REGION;
+	long rgsz;
+	long last_off = -1;
+	int hot = 0;
+	int i;
+
+	if (nrg < 1) {
+		nrg = 1;
+	}
+	rgsz = rg_bytes > 0 ? rg_bytes : (long)ws_pages * PAGING_PAGESZ / nrg;
+	if (rgsz < 1) {
+		rgsz = 1;
+	}
+	if ((file = fopen(path, "w")) == NULL) {
+		return -1;
+	}
+
+	/* The working set is allocated up front and then accessed */
+	fprintf(file, "%ld %d\n", prio, nrg + length);
+	for (i = 0; i < nrg; i++) {
+		fprintf(file, "alloc %ld %d\n", rgsz, i);
+	}
+	i = 0;
+	while (i < length) {
+		int rg = (rng_below(100) < locality) ? hot : (int)rng_below(nrg);
+		long op = mix_pick(ins_mix);
+		long off;
+		if (rg != hot) {
+			last_off = -1;
+		}
+		hot = rg;
+		/* Recycling a region takes two instructions */
+		if (op == WL_ALLOC && i + 2 > length) {
+			op = WL_CALC;
+		}
+		switch (op) {
+		case WL_CALC:
+			fprintf(file, "calc\n");
+			break;
+		case WL_ALLOC:
+			/* Recycle a region, keeping the working set size */
+			fprintf(file, "free %d\n", rg);
+			fprintf(file, "alloc %ld %d\n", rgsz, rg);
+			i++;
+			break;
+		case WL_READ:
+			off = last_off = pick_offset(rgsz, last_off, locality);
+			fprintf(file, "read %d %ld %ld\n", rg, off,
+				rng_below(WL_MAX_REGION));
+			break;
+		case WL_WRITE:
+			off = last_off = pick_offset(rgsz, last_off, locality);
+			fprintf(file, "write %ld %d %ld\n", rng_below(128), rg, off);
+			break;
+		case WL_SYSCALL_OP:
+			fprintf(file, "syscall %d %ld\n", WL_SYSCALL, rng_below(100));
+			break;
+		}
+		i++;
+	}
+	fclose(file);
+	return 0;
+}
+
+static void usage(void) {
+	printf("Usage: oswl [-o name] [-s seed] [-n count] [-P programs] "
+	       "[-L length]\n"
+	       "            [-a uniform|poisson|bursty] [-r rate] [-b burst]\n"
+	       "            [-p prio:w,...] [-m calc:w,alloc:w,read:w,"
+	       "write:w,syscall:w]\n"
+	       "            [-w pages] [-z bytes] [-l locality] [-t slot] "
+	       "[-c cpus]\n"
+	       "            [-R ram] [-S swap]\n");
+	exit(1);
+}
+
+int main(int argc, char * argv[]) {
+	const char * name = "wl";
+	const char * dist = "poisson";
+	uint64_t seed = 1;
+	long count = 100;
+	int nprog = 16;
+	int length = 50;
+	double rate = 0.03;
+	double burst = 8;
+	int ws_pages = 8;
+	long rg_bytes = 0;
+	int locality = 80;
+	int time_slot = 2;
+	int num_cpus = 4;
+	long memramsz = PAGING_MEMRAMSZ;
+	long memswpsz = 0x1000000;
+	struct wl_mix prio_mix, ins_mix;
+	char path[256];
+	long * prog_prio;
+	FILE * file;
+	int opt;
+	long i;
+
+	parse_mix("0:1,20:2,120:4", &prio_mix, NULL, 0);
+	parse_mix("40,10,20,20,10", &ins_mix, wl_ins_name, WL_NINS);
+
+	while ((opt = getopt(argc, argv, "o:s:n:P:L:a:r:b:p:m:w:z:l:t:c:R:S:")) != -1) {
+		switch (opt) {
+		case 'o': name = optarg; break;
+		case 's': seed = strtoull(optarg, NULL, 0); break;
+		case 'n': count = atol(optarg); break;
+		case 'P': nprog = atoi(optarg); break;
+		case 'L': length = atoi(optarg); break;
+		case 'a': dist = optarg; break;
+		case 'r': rate = atof(optarg); break;
+		case 'b': burst = atof(optarg); break;
+		case 'p':
+			if (parse_mix(optarg, &prio_mix, NULL, 0) != 0) usage();
+			break;
+		case 'm':
+			if (parse_mix(optarg, &ins_mix, wl_ins_name, WL_NINS) != 0)
+				usage();
+			break;
+		case 'w': ws_pages = atoi(optarg); break;
+		case 'z': rg_bytes = atol(optarg); break;
+		case 'l': locality = atoi(optarg); break;
+		case 't': time_slot = atoi(optarg); break;
+		case 'c': num_cpus = atoi(optarg); break;
+		case 'R': memramsz = atol(optarg); break;
+		case 'S': memswpsz = atol(optarg); break;
+		default: usage();
+		}
+	}
+	if (count < 0 || nprog < 1 || length < 1 || rate <= 0 || burst < 1 ||
+	    locality < 0 || locality > 100 || ws_pages < 1 || rg_bytes < 0 ||
+	    (strcmp(dist, "uniform") && strcmp(dist, "poisson") &&
+	     strcmp(dist, "bursty"))) {
+		usage();
+	}
+	for (i = 0; i < prio_mix.n; i++) {
+		if (prio_mix.val[i] < 0 || prio_mix.val[i] >= MAX_PRIO) usage();
+	}
+	rng_state = seed;
+
+	/* Program pool, each with its own default priority */
+	snprintf(path, sizeof(path), "input/proc/%s", name);
+	mkdir(path, 0755);
+	prog_prio = malloc(sizeof(long) * nprog);
+	for (i = 0; i < nprog; i++) {
+		prog_prio[i] = mix_pick(&prio_mix);
+		snprintf(path, sizeof(path), "input/proc/%s/%04ld", name, i);
+		if (gen_program(path, prog_prio[i], length, &ins_mix, ws_pages,
+				rg_bytes, locality) != 0) {
+			printf("Cannot write program %s\n", path);
+			return 1;
+		}
+	}
+
+	snprintf(path, sizeof(path), "input/%s", name);
+	if ((file = fopen(path, "w")) == NULL) {
+		printf("Cannot write config %s\n", path);
+		return 1;
+	}
+	fprintf(file, "%d %d %ld\n", time_slot, num_cpus, count);
+#ifndef MM_FIXED_MEMSZ
+	fprintf(file, "%ld %ld 0 0 0\n", memramsz, memswpsz);
+#endif
+
+	/* Arrival times in slots; bursty arrivals come in groups whose
+	 * start times are Poisson, keeping the same mean rate */
+	double t = 0;
+	long left_in_burst = 0;
+	for (i = 0; i < count; i++) {
+		if (!strcmp(dist, "uniform")) {
+			t = i / rate;
+		}else if (!strcmp(dist, "poisson")) {
+			t += rng_exp(1.0 / rate);
+		}else if (left_in_burst-- <= 0) {
+			t += rng_exp(burst / rate);
+			left_in_burst = (long)rng_exp(burst);
+		}
+		long prog = rng_below(nprog);
+		fprintf(file, "%ld %s/%04ld %ld\n", (long)t, name, prog,
+			prog_prio[prog]);
+	}
+	fclose(file);
+	free(prog_prio);
+
+	printf("Generated input/%s: %ld processes over %d programs\n",
+		name, count, nprog);
+	/* Past what the CPUs run, live processes pile up beyond the
+	 * scheduler queues and os rejects arrivals */
+	if (rate * length > num_cpus) {
+		printf("Warning: %.2f instructions per slot over %d CPUs, "
+		       "arrivals will be rejected\n", rate * length, num_cpus);
+	}
+	return 0;
+}
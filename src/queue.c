@@ -7,13 +7,13 @@ int empty(struct queue_t * q) {
 	return (q->size == 0);
 }
 
-void enqueue(struct queue_t * q, struct pcb_t * proc) {
-    if (q == NULL || proc == NULL) return; 
+int enqueue(struct queue_t * q, struct pcb_t * proc) {
+    if (q == NULL || proc == NULL) return -1; 
 
-    if (q->size < MAX_QUEUE_SIZE) {
-        q->proc[q->size] = proc; 
-        q->size++;
-    }
+    if (q->size >= MAX_QUEUE_SIZE) return -1;
+    q->proc[q->size] = proc; 
+    q->size++;
+    return 0;
 }
 
     
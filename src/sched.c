@@ -5,6 +5,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 static struct queue_t ready_queue;
 static struct queue_t run_queue;
 static pthread_mutex_t queue_lock;
@@ -25,6 +26,71 @@ int queue_empty(void) {
 	return (empty(&ready_queue) && empty(&run_queue));
 }
 
+void drop_proc(struct pcb_t * proc) {
+	int i, j = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	for (i = 0; i < running_list.size; i++) {
+		if (running_list.proc[i] != proc)
+			running_list.proc[j++] = running_list.proc[i];
+	}
+	running_list.size = j;
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* Whether the program of [proc] is [name], the last part of its path */
+static int proc_named(struct pcb_t * proc, const char * name) {
+	const char * base = strrchr(proc->path, '/');
+
+	return !strcmp(base ? base + 1 : proc->path, name);
+}
+
+int take_procs(const char * name, struct pcb_t * caller,
+		struct pcb_t ** procs, int max) {
+#ifdef MLQ_SCHED
+	struct queue_t * queues = mlq_ready_queue;
+	int nqueues = MAX_PRIO;
+#else
+	struct queue_t * queues = &ready_queue;
+	int nqueues = 1;
+#endif
+	struct pcb_t * proc;
+	int q, i, j, k, n = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	for (q = 0; q < nqueues && n < max; q++) {
+		for (i = 0, j = 0; i < queues[q].size; i++) {
+			proc = queues[q].proc[i];
+			if (n < max && proc != caller && proc_named(proc, name)) {
+				procs[n++] = proc;
+			}else{
+				queues[q].proc[j++] = proc;
+			}
+		}
+		queues[q].size = j;
+	}
+
+	for (i = 0, j = 0; i < running_list.size; i++) {
+		proc = running_list.proc[i];
+		for (k = 0; k < n && procs[k] != proc; k++)
+			;
+		if (k < n)
+			continue;
+		running_list.proc[j++] = proc;
+		/* Not ready, so on a CPU or about to be requeued. Its pc
+		 * belongs to that CPU, which sees the flag before running
+		 * it again */
+		if (proc != caller && proc_named(proc, name) && !proc->killed) {
+			printf("Terminating process %d with name %s from running_list\n",
+				proc->pid, proc->path);
+			__atomic_store_n(&proc->killed, 1, __ATOMIC_RELEASE);
+		}
+	}
+	running_list.size = j;
+	pthread_mutex_unlock(&queue_lock);
+	return n;
+}
+
 void init_scheduler(void) {
 #ifdef MLQ_SCHED
     int i ;
@@ -99,36 +165,27 @@ void put_proc(struct pcb_t * proc) {
 	proc->mlq_ready_queue = mlq_ready_queue;
 	proc->running_list = & running_list;
 
-	/* TODO: put running proc to running_list */
-
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&running_list, proc);
-	pthread_mutex_unlock(&queue_lock);
-
-
-	// pthread_mutex_lock(&queue_lock);
-	// if(!empty(&running_list)){
-	// 	dequeue(&running_list);
-	// }
-	// pthread_mutex_unlock(&queue_lock);
-
+	/* Still on running_list since add_proc. At most MAX_QUEUE_SIZE
+	 * processes live there, so its ready queue has room */
 	return put_mlq_proc(proc);
 }
 
-void add_proc(struct pcb_t * proc) {
+int add_proc(struct pcb_t * proc) {
+	int ret;
+
 	proc->ready_queue = &ready_queue;
 	proc->mlq_ready_queue = mlq_ready_queue;
 	proc->running_list = & running_list;
 
-	/* TODO: put running proc to running_list */
+	/* A process stays on running_list until it is dropped */
 	pthread_mutex_lock(&queue_lock);
-	enqueue(&running_list, proc);
+	ret = enqueue(&running_list, proc);
 	pthread_mutex_unlock(&queue_lock);
+	if (ret != 0)
+		return -1;
 
-	
-	// add_mlq_proc(proc);
-
-	return add_mlq_proc(proc);
+	add_mlq_proc(proc);
+	return 0;
 }
 #else
 struct pcb_t * get_proc(void) {
@@ -150,37 +207,25 @@ void put_proc(struct pcb_t * proc) {
 	proc->ready_queue = &ready_queue;
 	proc->running_list = & running_list;
 
-	/* TODO: put running proc to running_list */
-	pthread_mutex_lock(&queue_lock);
-    enqueue(&running_list, proc);
-    pthread_mutex_unlock(&queue_lock);
-
-
+	/* Still on running_list since add_proc */
     pthread_mutex_lock(&queue_lock);
     enqueue(&ready_queue, proc);
     pthread_mutex_unlock(&queue_lock);
-
-
-	// pthread_mutex_lock(&queue_lock);
-	// if(!empty(&running_list)){
-	// 	dequeue(&running_list);
-	// }
-	// pthread_mutex_unlock(&queue_lock);
-	// return put_mlq_proc(proc);
 }
 
-void add_proc(struct pcb_t * proc) {
+int add_proc(struct pcb_t * proc) {
+	int ret;
+
 	proc->ready_queue = &ready_queue;
 	proc->running_list = & running_list;
 
-	/* TODO: put running proc to running_list */
+	/* Both queues hold the same processes, so both have room or not */
 	pthread_mutex_lock(&queue_lock);
-    enqueue(&running_list, proc);
-    pthread_mutex_unlock(&queue_lock);
-
-    pthread_mutex_lock(&queue_lock);
-    enqueue(&ready_queue, proc);
+    ret = enqueue(&running_list, proc);
+    if (ret == 0)
+        enqueue(&ready_queue, proc);
     pthread_mutex_unlock(&queue_lock);
+    return ret;
 }
 #endif
 
@@ -12,70 +12,33 @@
  #include "syscall.h"
  #include "stdio.h"
  #include "libmem.h"
+ #include "mm.h"
  
 
  #include "string.h"
  #include "queue.h"
+ #include "loader.h"
+ #include "sched.h"
  #include <stdlib.h>
 
+ /*terminate_process - release everything a process holds
+  *
+  *Shared by normal exit and killall. The pcb itself is left to the
+  *caller, which may still have to take it off a queue.
+  */
  void terminate_process(struct pcb_t *pcb){
-     for(int i = 0; i < 10; i++){
-         if(pcb->regs[i] != 0){
-             libfree(pcb, i);
-             pcb->regs[i] = 0;
-         }
-     }
- 
      if(pcb->code){
-         if(pcb->code->text) free(pcb->code->text);
-         free(pcb->code);
+         put_code(pcb->code);
          pcb->code = NULL;
      }
  
      #ifdef MM_PAGING
-     if (pcb->mm) {
- 
-         if (pcb->mm->pgd) {
-             free(pcb->mm->pgd);
-             pcb->mm->pgd = NULL;
-         }
- 
-         struct vm_area_struct *vma = pcb->mm->mmap;
-         while (vma) {
-             struct vm_area_struct *next = vma->vm_next;
+     /* Every region, frame and swap frame goes with the mm */
+     free_mm(pcb);
  
-             struct vm_rg_struct *rg = vma->vm_freerg_list;
-             while (rg) {
-                 struct vm_rg_struct *next_rg = rg->rg_next;
-                 free(rg);
-                 rg = next_rg;
-             }
-             free(vma);
-             vma = next;
-         }
-  
-         struct pgn_t *pgn = pcb->mm->fifo_pgn;
-         while (pgn) {
-             struct pgn_t *next = pgn->pg_next;
-             free(pgn);
-             pgn = next;
-         }
-         free(pcb->mm);
-         pcb->mm = NULL;
-     }
-     if (pcb->mram) {
- 
-         free(pcb->mram);
-         pcb->mram = NULL;
-     }
-     if (pcb->mswp) {
-    
-         free(pcb->mswp);
-         pcb->mswp = NULL;
-     }
-     if (pcb->active_mswp) {
-         pcb->active_mswp = NULL;
-     }
+     /* The devices belong to the machine, not to the process */
+     pcb->mram = NULL;
+     pcb->mswp = NULL;
      #endif   
      
      if(pcb->page_table){
@@ -90,12 +53,6 @@
      }
  }
  
- void remove_from_queue(struct queue_t *queue, int index){
-     for(int k = index; k < (queue->size -1); k++){
-         queue->proc[k] = queue->proc[k +1];
-     }
-     queue->size--;
- }
  int __sys_killall(struct pcb_t *caller, struct sc_regs* regs)
  {
      char proc_name[100];
@@ -116,51 +73,19 @@
      }
      printf("The procname retrieved from memregionid %d is \"%s\"\n", memrg, proc_name);
  
-     /* TODO: Traverse proclist to terminate the proc
-      *       stcmp to check the process match proc_name
-      */
-     //caller->running_list
-     //caller->mlq_ready_queu
-
-     for(int prio = 0; prio < MAX_PRIO; prio++){
-         struct queue_t *queue = &caller->mlq_ready_queue[prio];
-         if(queue->size == 0) continue;
-         int j = 0;
-         while(j < queue->size){
-             struct pcb_t *proc = queue->proc[j];
-             char *proc_name_in_path = strrchr(proc->path, '/');
-             if(proc_name_in_path) proc_name_in_path++;
-             else proc_name_in_path = proc->path;
-             
-             if(strcmp(proc_name_in_path, proc_name) == 0 && proc != caller ){
-                 printf("Terminating process %d with name %s from mlq_ready_queue[%d]\n",
-                         proc->pid, proc->path, prio); 
-                 terminate_process(proc);
-                 remove_from_queue(queue, j);
-                 free(proc);
-             } else{
-                 j++;
-             }
+     /* Matching processes leave the scheduler under its lock, and are
+      * only freed once no other CPU can reach them */
+     struct pcb_t *procs[MAX_QUEUE_SIZE];
+     int n;
+     do {
+         n = take_procs(proc_name, caller, procs, MAX_QUEUE_SIZE);
+         for(int j = 0; j < n; j++){
+             printf("Terminating process %d with name %s from mlq_ready_queue[%d]\n",
+                     procs[j]->pid, procs[j]->path, procs[j]->prio);
+             terminate_process(procs[j]);
+             free(procs[j]);
          }
-     }
-     struct queue_t *running_queue = caller->running_list;
-     int j = 0;
-     while( j < running_queue->size){
-         struct pcb_t *proc = running_queue->proc[j];
-         char *proc_name_in_path = strrchr(proc->path, '/');
-         if(proc_name_in_path) proc_name_in_path++;
-         else proc_name_in_path = proc->path;
- 
-         if(strcmp(proc_name_in_path, proc_name) == 0 && proc != caller ){
-             printf("Terminating process %d with name %s from running_list\n",
-                     proc->pid, proc->path); 
-             terminate_process(proc);
-             remove_from_queue(running_queue, j);
-             free(proc);
-         } else{
-             j++;
-         }
-     }
+     } while(n == MAX_QUEUE_SIZE);
 
      /* TODO Maching and terminating 
       *       all processes with given
@@ -11,6 +11,7 @@
 #include "syscall.h"
 #include "libmem.h"
 #include "mm.h"
+#include <pthread.h>
 
 //typedef char BYTE;
 
@@ -24,10 +25,15 @@ int __sys_memmap(struct pcb_t *caller, struct sc_regs* regs)
             /* Reserved process case*/
             break;
    case SYSMEM_INC_OP:
-            inc_vma_limit(caller, regs->a2, regs->a3);
+            pthread_mutex_lock(&caller->mm->lock);
+            inc_vma_limit(caller, regs->a2, regs->a3, 0);
+            pthread_mutex_unlock(&caller->mm->lock);
             break;
    case SYSMEM_SWP_OP:
-            __mm_swap_page(caller, regs->a2, regs->a3);
+            /* Evictions issue it with the (recursive) lock held */
+            pthread_mutex_lock(&caller->mm->lock);
+            __mm_swap_page(caller, regs->a2, regs->a3, regs->a4);
+            pthread_mutex_unlock(&caller->mm->lock);
             break;
    case SYSMEM_IO_READ:
             MEMPHY_read(caller->mram, regs->a2, &value);